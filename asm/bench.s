@@ -0,0 +1,34 @@
+; Busy loop used by the emulator benchmark (retrolab_bench). Unlike the other samples, it never
+; sits idle, and it goes through most of the addressing modes.
+
+start:
+        mov     A, 0
+.next:
+        mov     B, A
+        mul     B, 3
+        add     B, [A + buffer]
+        mov     [A + buffer], B
+        mov     C, ^[counter]
+        inc     C
+        mov     ^[counter], C
+        pushw   C
+        popw    D
+        ifne    D, C
+        jmp     error
+        inc     A
+        and     A, 0xff
+        jsr     mix
+        jmp     .next
+
+mix:
+        xor     E, A
+        shr     E, 1
+        ret
+
+error:
+        jmp     error
+
+counter:
+        dw      0
+buffer:
+        bss     256
@@ -0,0 +1,322 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler/compiler.h"
+#include "compiler/input.h"
+#include "compiler/output.h"
+#include "emulator/cpu.h"
+#include "emulator/emulator.h"
+#include "emulator/machine.h"
+#include "emulator/memory.h"
+#include "exec/exec.h"
+#include "mmap.h"
+
+// Runs many programs at once, one per thread, each one on its own headless machine, for a fixed
+// budget of cycles, and prints one line of JSON per program as they finish. Source files (*.s) and
+// directories are compiled first; any other file is loaded as a ROM.
+//
+// The compiler keeps global state, so only one program is compiled at a time; everything else runs
+// in parallel. Jobs are taken from a shared counter, so a thread that finishes early keeps taking
+// jobs until there are none left.
+
+#define SCREEN_LINES    30
+#define SCREEN_COLUMNS  40
+#define LINE_SZ         (16 * 1024)
+
+typedef struct {
+    const char** files;
+    size_t       n_files;
+    atomic_size_t next_job;
+    uint64_t     cycles;         // budget for each job
+    uint64_t     seed;
+} Batch;
+
+static pthread_mutex_t compiler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// {{{ loading
+
+static bool
+ends_with(const char* s, const char* suffix)
+{
+    size_t len = strlen(s), sfx = strlen(suffix);
+    return len >= sfx && strcmp(&s[len - sfx], suffix) == 0;
+}
+
+// Compiles or loads `filename` into the selected machine. Returns NULL, or the error.
+static char*
+load(const char* filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return strdup("file not found");
+
+    if (!S_ISDIR(st.st_mode) && !ends_with(filename, ".s")) {
+        FILE* f = fopen(filename, "rb");
+        if (!f)
+            return strdup("could not open file");
+        uint8_t* rom = malloc(0x10000);
+        size_t sz = fread(rom, 1, 0x10000, f);     // one byte more than ram_load takes
+        fclose(f);
+        if (sz > 0xFFFF) {
+            free(rom);
+            return strdup("ROM too large");
+        }
+        int r = ram_load(0, rom, sz);
+        free(rom);
+        return r < 0 ? strdup("could not load ROM") : NULL;
+    }
+
+    pthread_mutex_lock(&compiler_lock);
+    Output* output;
+    if (S_ISDIR(st.st_mode)) {
+        Input* input = exec_input_from_dir(filename);
+        if (!input) {
+            pthread_mutex_unlock(&compiler_lock);
+            return strdup("could not read source directory");
+        }
+        output = compile_input(input);
+        input_free(input);
+    } else {
+        output = compile_file(filename);
+    }
+    pthread_mutex_unlock(&compiler_lock);
+
+    char* error = NULL;
+    if (output_error_message(output))
+        error = strdup(output_error_message(output));
+    else if (ram_load(0, output_binary_data(output), output_binary_size(output)) < 0)
+        error = strdup("program too large");
+    output_free(output);
+    return error;
+}
+
+// }}}
+
+// {{{ results
+
+#define PRINT(...) { n += snprintf(&buf[n], bufsz - n, __VA_ARGS__); if (n >= bufsz) n = bufsz - 1; }
+
+static size_t
+print_json_string(char* buf, size_t bufsz, const char* s, size_t len)
+{
+    size_t n = 0;
+    PRINT("\"")
+    for (size_t i = 0; i < len && s[i]; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            PRINT("\\%c", c)
+        else if (c < 0x20 || c >= 0x7f)
+            PRINT("\\u%04x", c)
+        else
+            PRINT("%c", c)
+    }
+    PRINT("\"")
+    return n;
+}
+
+static size_t
+print_screen(char* buf, size_t bufsz)
+{
+    size_t n = 0;
+    PRINT("[")
+    for (int y = 0; y < SCREEN_LINES; ++y) {
+        char line[SCREEN_COLUMNS];
+        int len = 0;
+        for (int x = 0; x < SCREEN_COLUMNS; ++x) {
+            line[x] = (char) ram_get(VIDEO_TXT + y * SCREEN_COLUMNS + x);
+            if (line[x] == 0)
+                line[x] = ' ';
+            if (line[x] != ' ')
+                len = x + 1;
+        }
+        if (y > 0)
+            PRINT(",")
+        n += print_json_string(&buf[n], bufsz - n, line, len);
+    }
+    PRINT("]")
+    return n;
+}
+
+static void
+run_job(Batch* batch, size_t job)
+{
+    const char* filename = batch->files[job];
+    static _Thread_local char buf[LINE_SZ];
+    size_t bufsz = sizeof buf;
+    size_t n = 0;
+
+    RetrolabMachine* m = machine_new();
+    RetrolabMachine* previous = machine_select(m);
+    emulator_init(true);        // headless, as all machines from machine_new
+    cpu_set_random_seed(batch->seed);
+
+    PRINT("{\"job\":%zu,\"file\":", job)
+    n += print_json_string(&buf[n], bufsz - n, filename, strlen(filename));
+
+    char* error = load(filename);
+    if (error) {
+        PRINT(",\"exit\":\"load_error\",\"error\":")
+        n += print_json_string(&buf[n], bufsz - n, error, strlen(error));
+        free(error);
+    } else {
+        uint64_t start = emulator_cycles();
+        while (emulator_cycles() - start < batch->cycles) {
+            uint64_t left = batch->cycles - (emulator_cycles() - start);
+            if (emulator_run_cycles(left < STEPS_PER_FRAME ? (int) left : STEPS_PER_FRAME, 0) == EMULATOR_STOP_ERROR)
+                break;
+        }
+        uint64_t cycles = emulator_cycles() - start;
+        PRINT(",\"exit\":\"%s\"", cpu_error() == CPU_ERROR_NO_ERROR ? "budget" : "cpu_error")
+        PRINT(",\"error\":%d", cpu_error())
+        PRINT(",\"pc\":%d", cpu_PC())
+        PRINT(",\"cycles\":%llu", (unsigned long long) cycles)
+        PRINT(",\"ram_hash\":\"%016llx\"", (unsigned long long) ram_hash())
+        PRINT(",\"screen\":")
+        n += print_screen(&buf[n], bufsz - n);
+    }
+    PRINT("}\n")
+
+    machine_select(previous);
+    machine_free(m);
+
+    pthread_mutex_lock(&output_lock);
+    fwrite(buf, 1, n, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&output_lock);
+}
+
+#undef PRINT
+
+// }}}
+
+// {{{ thread pool
+
+static void*
+worker(void* data)
+{
+    Batch* batch = data;
+    for (;;) {
+        size_t job = atomic_fetch_add(&batch->next_job, 1);
+        if (job >= batch->n_files)
+            return NULL;
+        run_job(batch, job);
+    }
+}
+
+static int
+run_batch(Batch* batch, int n_threads)
+{
+    if ((size_t) n_threads > batch->n_files)
+        n_threads = (int) batch->n_files;
+    pthread_t threads[n_threads];
+    int started = 0;
+    for (; started < n_threads; ++started)
+        if (pthread_create(&threads[started], NULL, worker, batch) != 0)
+            break;
+    if (started == 0)
+        worker(batch);      // no threads: run everything in this one
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
+
+// }}}
+
+// {{{ command line
+
+// Reads one file name per line (empty lines are ignored).
+static size_t
+read_list(const char* filename, const char*** files, size_t n_files)
+{
+    FILE* f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        *files = realloc(*files, (n_files + 1) * sizeof(const char*));
+        (*files)[n_files++] = strdup(line);
+    }
+    if (f != stdin)
+        fclose(f);
+    return n_files;
+}
+
+static void
+show_help(const char* program_name)
+{
+    printf("Usage: %s [OPTIONS] FILE...\n", program_name);
+    printf("Runs each ROM, source file (*.s) or source directory, and prints one JSON line per job.\n");
+    printf("   -f, --frames         Frames to run each program for (default 600)\n");
+    printf("   -n, --cycles         Cycles (CPU steps) to run each program for\n");
+    printf("   -j, --jobs           Number of threads (default: one per core)\n");
+    printf("   -l, --list           Read the files from a list, one per line ('-' for stdin)\n");
+    printf("   -S, --seed           Seed for CPU_RANDOM (default 0)\n");
+    printf("   -h, --help           Show this help\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char** files = NULL;
+    size_t n_files = 0;
+    uint64_t cycles = 600 * (uint64_t) STEPS_PER_FRAME;
+    uint64_t seed = 0;
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    static struct option long_options[] = {
+        { "frames", required_argument, 0, 'f' },
+        { "cycles", required_argument, 0, 'n' },
+        { "jobs",   required_argument, 0, 'j' },
+        { "list",   required_argument, 0, 'l' },
+        { "seed",   required_argument, 0, 'S' },
+        { "help",   no_argument,       0, 'h' },
+        { 0, 0, 0, 0 },
+    };
+    int c, opt_idx;
+    while ((c = getopt_long(argc, argv, "f:n:j:l:S:h", long_options, &opt_idx)) != -1) {
+        switch (c) {
+            case 'f': cycles = strtoull(optarg, NULL, 0) * STEPS_PER_FRAME; break;
+            case 'n': cycles = strtoull(optarg, NULL, 0); break;
+            case 'j': n_threads = strtol(optarg, NULL, 0); break;
+            case 'l': n_files = read_list(optarg, &files, n_files); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'h': show_help(argv[0]); exit(0);
+            default:  show_help(argv[0]); exit(1);
+        }
+    }
+    for (int i = optind; i < argc; ++i) {
+        files = realloc(files, (n_files + 1) * sizeof(const char*));
+        files[n_files++] = strdup(argv[i]);
+    }
+    if (n_files == 0) {
+        show_help(argv[0]);
+        return 1;
+    }
+    if (n_threads < 1)
+        n_threads = 1;
+
+    Batch batch = { .files = files, .n_files = n_files, .cycles = cycles, .seed = seed };
+    atomic_init(&batch.next_job, 0);
+    int r = run_batch(&batch, (int) n_threads);
+
+    for (size_t i = 0; i < n_files; ++i)
+        free((void *) files[i]);
+    free(files);
+    return r;
+}
+
+// }}}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator/cpu.h"
+#include "emulator/emulator.h"
+#include "emulator/memory.h"
+#include "exec/exec.h"
+
+// Runs each program given in the command line for a fixed number of frames, without video, and
+// reports how many instructions per second the emulator executes, and how many of them didn't need a
+// dispatch of their own because they were fused with the previous one (see decode.h). The steps an
+// idle CPU skips (see cpu_run) are not instructions executed, so they're left out. Source files (*.s)
+// are compiled before running; any other file is loaded as a ROM.
+
+#define FRAMES 600    // 10 seconds of emulated time
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int
+load(const char* filename)
+{
+    size_t len = strlen(filename);
+    if (len > 2 && strcmp(&filename[len - 2], ".s") == 0)
+        return exec_compile_file_to_ram(filename);
+
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open file '%s'.\n", filename);
+        return 1;
+    }
+    fclose(f);
+    emulator_load_rom(filename);
+    return 0;
+}
+
+static int
+bench(const char* filename)
+{
+    emulator_init(true);
+    cpu_set_random_seed(0);
+    if (load(filename) != 0)
+        return 1;
+
+    uint64_t fused = cpu_fused_steps();
+    uint64_t idle = cpu_idle_steps();
+    uint64_t cycles = emulator_cycles();
+    double start = now();
+    for (int i = 0; i < FRAMES; ++i) {
+        if (emulator_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_ERROR) {
+            fprintf(stderr, "%s: CPU error in frame %d.\n", filename, i);
+            return 1;
+        }
+    }
+    double elapsed = now() - start;
+    fused = cpu_fused_steps() - fused;
+    idle = cpu_idle_steps() - idle;
+    cycles = emulator_cycles() - cycles;
+
+    double steps = (double) (cycles - idle);
+    printf("%-40s %9.2f Minstr/s  %8.1fx real time  %5.1f%% fused\n", filename, steps / elapsed / 1e6,
+            (FRAMES / 60.0) / elapsed, 100.0 * (double) fused / steps);
+
+    emulator_destroy();
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc <= 1) {
+        fprintf(stderr, "Usage: %s FILE [FILE...]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; ++i)
+        if (bench(argv[i]) != 0)
+            return 1;
+    return 0;
+}
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -7,21 +7,53 @@
 #include <string.h>
 
 #include "cpu.h"
+#include "machinestate.h"
+#include "memory.h"
 
-static Breakpoint* bkps    = NULL;
-static size_t      n_bkps  = 0;
-static long        tmp_brk = -1;
+// breakpoint state, in the machine currently selected (see machine.h)
+#define bkps     (current_machine->breakpoints.bkps)
+#define n_bkps   (current_machine->breakpoints.n_bkps)
+#define tmp_brk  (current_machine->breakpoints.tmp_brk)
+#define bkp_map  (current_machine->breakpoints.map)
+#define watchpoints    (current_machine->breakpoints.watchpoints)
+#define n_watchpoints  (current_machine->breakpoints.n_watchpoints)
+#define last_hit       (current_machine->breakpoints.last_hit)
+#define any_hit        (current_machine->breakpoints.any_hit)
+#define triggered      (current_machine->breakpoints.triggered)
+
+static inline void
+map_set(long addr, bool v)
+{
+    if (v)
+        bkp_map[addr >> 3] |= (1 << (addr & 7));
+    else
+        bkp_map[addr >> 3] &= ~(1 << (addr & 7));
+}
+
+static inline bool
+map_get(long addr)
+{
+    return bkp_map[addr >> 3] & (1 << (addr & 7));
+}
 
 void
 bkps_clear()
 {
     if (bkps) {
-        for (size_t i=0; i < n_bkps; ++i)
+        for (size_t i=0; i < n_bkps; ++i) {
+            map_set(bkps[i].addr, false);
             free(bkps[i].filename);
+        }
         free(bkps);
     }
     n_bkps = 0;
     bkps = NULL;
+
+    free(watchpoints);
+    watchpoints = NULL;
+    n_watchpoints = 0;
+    any_hit = triggered = false;
+    ram_unwatch_all();
 }
 
 int
@@ -30,10 +62,18 @@ bkps_swap(const char* filename, size_t line)
     for (size_t i = 0; i < n_bkps; ++i) {
         if (bkps[i].line == line && strcmp(bkps[i].filename, filename) == 0) {
             // remove item and return
+            long addr = bkps[i].addr;
             free(bkps[i].filename);
             if (i != (n_bkps - 1))
-                memmove(&bkps[i], &bkps[i+1], (n_bkps - i) * sizeof(Breakpoint));
+                memmove(&bkps[i], &bkps[i+1], (n_bkps - i - 1) * sizeof(Breakpoint));
             bkps = realloc(bkps, sizeof(Breakpoint) * --n_bkps);
+
+            // another line might have a breakpoint in the same address
+            bool still_set = false;
+            for (size_t j = 0; j < n_bkps; ++j)
+                if (bkps[j].addr == addr)
+                    still_set = true;
+            map_set(addr, still_set);
             return -1;
         }
     }
@@ -48,6 +88,7 @@ bkps_swap(const char* filename, size_t line)
         .line     = line,
         .addr     = addr,
     };
+    map_set(addr, true);
     return 1;
 }
 
@@ -69,17 +110,95 @@ bkps_item(size_t n)
     return &bkps[n];
 }
 
+// {{{ watchpoints
+
+static void
+update_watch_map()
+{
+    ram_unwatch_all();
+    for (size_t i = 0; i < n_watchpoints; ++i)
+        ram_watch(watchpoints[i].start, watchpoints[i].end, watchpoints[i].kinds);
+}
+
+int
+bkps_watch_add(uint16_t start, uint16_t end, uint8_t kinds)
+{
+    if (start > end || kinds == 0 || (kinds & ~(WATCH_READ | WATCH_WRITE | WATCH_CHANGE)))
+        return -1;
+    watchpoints = realloc(watchpoints, sizeof(Watchpoint) * ++n_watchpoints);
+    watchpoints[n_watchpoints-1] = (Watchpoint) { .start = start, .end = end, .kinds = kinds };
+    ram_watch(start, end, kinds);
+    return 0;
+}
+
+bool
+bkps_watch_remove(uint16_t start, uint16_t end)
+{
+    for (size_t i = 0; i < n_watchpoints; ++i) {
+        if (watchpoints[i].start == start && watchpoints[i].end == end) {
+            if (i != (n_watchpoints - 1))
+                memmove(&watchpoints[i], &watchpoints[i+1], (n_watchpoints - i - 1) * sizeof(Watchpoint));
+            --n_watchpoints;
+            update_watch_map();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called by the memory for every access to a watched page.
+void
+bkps_watch_access(uint16_t addr, WatchKind kind, uint8_t old_value, uint8_t new_value)
+{
+    for (size_t i = 0; i < n_watchpoints; ++i) {
+        const Watchpoint* w = &watchpoints[i];
+        if (addr < w->start || addr > w->end)
+            continue;
+        WatchKind hit;
+        if (kind == WATCH_READ && (w->kinds & WATCH_READ))
+            hit = WATCH_READ;
+        else if (kind == WATCH_WRITE && (w->kinds & WATCH_WRITE))
+            hit = WATCH_WRITE;
+        else if (kind == WATCH_WRITE && (w->kinds & WATCH_CHANGE) && old_value != new_value)
+            hit = WATCH_CHANGE;
+        else
+            continue;
+        last_hit = (WatchHit) { .addr = addr, .kind = hit, .old_value = old_value, .new_value = new_value };
+        any_hit = triggered = true;
+        return;
+    }
+}
+
+bool
+bkps_watch_triggered()
+{
+    bool t = triggered;
+    triggered = false;
+    return t;
+}
+
+const WatchHit*
+bkps_watch_last_hit()
+{
+    return any_hit ? &last_hit : NULL;
+}
+
+// }}}
+
+bool
+bkps_armed()
+{
+    return n_bkps > 0 || tmp_brk != -1 || n_watchpoints > 0;
+}
+
 bool
 bkps_is_addr(long addr)
 {
-    if (tmp_brk == addr) {
+    if (tmp_brk != -1 && tmp_brk == addr) {
         tmp_brk = -1;
         return true;
     }
-    for (size_t i=0; i < n_bkps; ++i)
-        if (bkps[i].addr == addr)
-            return true;
-    return false;
+    return addr >= 0 && addr < MEMSZ && map_get(addr);
 }
 
 int
@@ -92,7 +211,21 @@ bkps_dbg_json(char* buf, size_t bufsz)
         PRINT("{\"filename\":\"%s\",\"line\":%zu},", bkps[i].filename, bkps[i].line)
     if (n_bkps > 0)
         --n;
-    PRINT("]")
+    PRINT("],\"watchpoints\":[")
+    for (size_t i = 0; i < n_watchpoints; ++i)
+        PRINT("%s{\"start\":%d,\"end\":%d,\"read\":%s,\"write\":%s,\"change\":%s}", i > 0 ? "," : "",
+                watchpoints[i].start, watchpoints[i].end,
+                (watchpoints[i].kinds & WATCH_READ) ? "true" : "false",
+                (watchpoints[i].kinds & WATCH_WRITE) ? "true" : "false",
+                (watchpoints[i].kinds & WATCH_CHANGE) ? "true" : "false")
+    PRINT("],\"watchHit\":")
+    if (any_hit) {
+        static const char* kind_names[] = { [WATCH_READ] = "read", [WATCH_WRITE] = "write", [WATCH_CHANGE] = "change" };
+        PRINT("{\"addr\":%d,\"kind\":\"%s\",\"old\":%d,\"new\":%d}", last_hit.addr, kind_names[last_hit.kind],
+                last_hit.old_value, last_hit.new_value)
+    } else {
+        PRINT("null")
+    }
 #undef PRINT
     return n;
 }
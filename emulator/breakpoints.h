@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct Breakpoint {
     char*   filename;
@@ -10,11 +11,40 @@ typedef struct Breakpoint {
     long    addr;
 } Breakpoint;
 
-void              bkps_clear();
+// Watchpoints stop the program when it reads, writes or changes any byte in a range of memory.
+// The memory only looks for them in the pages (256 bytes) that have one (see ram_watch), so
+// accesses to any other page cost nothing. Reads are the operands read by the instructions.
+typedef enum {
+    WATCH_READ   = 1 << 0,
+    WATCH_WRITE  = 1 << 1,
+    WATCH_CHANGE = 1 << 2,      // a write of a different value
+} WatchKind;
+
+typedef struct Watchpoint {
+    uint16_t start;
+    uint16_t end;       // inclusive
+    uint8_t  kinds;     // WatchKind flags
+} Watchpoint;
+
+typedef struct WatchHit {
+    uint16_t addr;
+    uint8_t  kind;      // WatchKind
+    uint8_t  old_value; // the value read, for reads
+    uint8_t  new_value;
+} WatchHit;
+
+void              bkps_clear();     // breakpoints and watchpoints
 int               bkps_swap(const char* filename, size_t line);
 
+int               bkps_watch_add(uint16_t start, uint16_t end, uint8_t kinds);   // -1 if invalid
+bool              bkps_watch_remove(uint16_t start, uint16_t end);
+void              bkps_watch_access(uint16_t addr, WatchKind kind, uint8_t old_value, uint8_t new_value);
+bool              bkps_watch_triggered();   // a watchpoint was hit since the last call
+const WatchHit*   bkps_watch_last_hit();    // NULL if none was ever hit
+
 void              bkps_set_tmp_brk(long addr);
 
+bool              bkps_armed();
 bool              bkps_is_addr(long addr);
 
 int               bkps_dbg_json(char* buf, size_t bufsz);
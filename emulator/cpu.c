@@ -1,37 +1,40 @@
 #include "cpu.h"
 
 #include "breakpoints.h"
+#include "decode.h"
+#include "jit.h"
+#include "machinestate.h"
 #include "memory.h"
 #include "mmap.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #if !__EMSCRIPTEN__
 #  define SUPPORT_DEBUG 1
 #endif
 
-static reg_t reg[16] = { 0 };
-static bool skip_next = false;
-static bool debugging_mode = false;
-static CpuError _cpu_error = CPU_ERROR_NO_ERROR;
-
-static Interrupts ints = {
-    .vector    = { NO_INTERRUPT },
-    .queue     = {},
-    .queue_idx = 0,
-    .active    = true,
-    .happening = false,
-    .waiting   = false,
-    .ret_addr  = 0,
-};
-
-static void(*hw_fptr[256])(uint16_t data) = { NULL };
-
-static DebuggingInfo* dbg = NULL;
-static bool           break_next = false;
+// CPU state, in the machine currently selected (see machine.h)
+#define reg             (current_machine->cpu.reg)
+#define skip_next       (current_machine->cpu.skip_next)
+#define debugging_mode  (current_machine->cpu.debugging_mode)
+#define _cpu_error      (current_machine->cpu.error)
+#define ints            (current_machine->cpu.ints)
+#define hw_fptr         (current_machine->cpu.hw_fptr)
+#define dbg             (current_machine->cpu.dbg)
+#define break_next      (current_machine->cpu.break_next)
+#define decoded         (current_machine->cpu.decoded)
+#define random_state    (current_machine->cpu.random)
+#define fused_steps     (current_machine->cpu.fused_steps)
+#define idle_steps      (current_machine->cpu.idle_steps)
+#define stall_steps     (current_machine->cpu.stall)
+#define tracing         (current_machine->trace.records != NULL)  // see trace.c
 
 #define A  (reg[0x0])
 #define B  (reg[0x1])
@@ -50,6 +53,68 @@ static bool           break_next = false;
 #define PC (reg[0xe])
 #define OV (reg[0xf])
 
+// {{{ random numbers
+
+// CPU_RANDOM is generated when an instruction reads it (xorshift64*), instead of on every step.
+// The sequence only depends on the seed and on the reads, so runs with the same seed are
+// reproducible.
+
+void
+cpu_set_random_seed(uint64_t seed)
+{
+    // splitmix64, so that similar seeds give unrelated sequences (and the state is never zero)
+    uint64_t z = seed + 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    random_state = (z ^ (z >> 31)) | 1;
+}
+
+static void
+generate_random()
+{
+    USE_CURRENT_MACHINE();
+    uint64_t x = random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random_state = x;
+    uint16_t r = (x * 0x2545f4914f6cdd1d) >> 48;
+    ram[CPU_RANDOM] = r & 0xff;
+    ram[CPU_RANDOM+1] = r >> 8;
+}
+
+// refresh CPU_RANDOM if a read of `sz` bytes at `addr` touches it
+static inline void
+check_random(reg_t addr, reg_t sz)
+{
+    if ((reg_t) (addr - (CPU_RANDOM - sz + 1)) <= sz)
+        generate_random();
+}
+
+// }}}
+
+// {{{ watchpoints
+
+static void
+watch_read(reg_t addr, reg_t sz)
+{
+    for (reg_t i = 0; i < sz; ++i) {
+        reg_t a = addr + i;
+        if (ram_watched(a) & WATCH_READ)
+            bkps_watch_access(a, WATCH_READ, ram[a], ram[a]);
+    }
+}
+
+// tell the watchpoints about a read of `sz` bytes at `addr`, if its page is being watched
+static inline void
+check_watch(reg_t addr, reg_t sz)
+{
+    if ((ram_watched(addr) | ram_watched(addr + sz - 1)) & WATCH_READ)
+        watch_read(addr, sz);
+}
+
+// }}}
+
 // {{{ memory manager
 
 #define min(a,b) \
@@ -57,14 +122,119 @@ static bool           break_next = false;
       __typeof__ (b) _b = (b); \
     _a < _b ? _a : _b; })
 
+// The memory manager device (DEV_MEM_MGR) works on blocks of memory, which never go past the end of
+// the memory. Each command keeps the CPU busy for a number of steps that only depends on the size of
+// the block (see `stall_steps`), so the guest timing doesn't depend on the host. The work is done by
+// memmove, memset, memchr and loops that the compiler can vectorise. A block read of CPU_RANDOM
+// gets a new random number, and the watchpoints see the blocks, as they would see any other access.
+
+#define MEM_BYTES_PER_STEP  16      // copy, set, compare, find
+#define CRC_BYTES_PER_STEP  4
+
+// size of a block of `sz` bytes at `addr`, clamped to the end of the memory
+static size_t
+block_size(uint16_t addr, size_t sz)
+{
+    return min(sz, (size_t) (MEMSZ - addr));
+}
+
+static void
+busy(size_t sz, size_t bytes_per_step)
+{
+    stall_steps = (uint32_t) ((sz + bytes_per_step - 1) / bytes_per_step);
+}
+
+// offset of the first byte that differs, or `sz` if none does
+static size_t
+compare(const uint8_t* a, const uint8_t* b, size_t sz)
+{
+    size_t i = 0;
+    for (; i + 8 <= sz; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, &a[i], 8);
+        memcpy(&wb, &b[i], 8);
+        if (wa != wb)
+            break;
+    }
+    while (i < sz && a[i] == b[i])
+        ++i;
+    return i;
+}
+
+// CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF)
+static uint16_t
+crc16(const uint8_t* data, size_t sz)
+{
+    static const uint16_t table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    };
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < sz; ++i) {
+        crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0xf)];
+    }
+    return crc;
+}
+
 static void memory_manager(uint16_t command)
 {
+    USE_CURRENT_MACHINE();
+    size_t n;
     switch (command) {
         case MEM_CPY:
-            memmove(&ram[F], &ram[X], min(Y, 0xFFFF - Y + 1));
+            n = min(block_size(X, Y), block_size(F, Y));
+            check_random(X, n);
+            ram_reading(X, n);
+            ram_writing(F, n, &ram[X], n);
+            memmove(&ram[F], &ram[X], n);
+            ram_written(F, n);
+            busy(n, MEM_BYTES_PER_STEP);
             break;
         case MEM_SET:
-            memset(&ram[X], F & 0xff, min(Y, 0xfff - Y + 1));
+            n = block_size(X, Y);
+            ram_writing(X, n, &(uint8_t) { F & 0xff }, 1);
+            memset(&ram[X], F & 0xff, n);
+            ram_written(X, n);
+            busy(n, MEM_BYTES_PER_STEP);
+            break;
+        case MEM_SET16: {
+            n = block_size(X, 2 * (size_t) Y) & ~(size_t) 1;
+            uint8_t* p = &ram[X];
+            uint8_t lo = F & 0xff, hi = F >> 8;
+            ram_writing(X, n, (uint8_t[]) { lo, hi }, 2);
+            for (size_t i = 0; i < n; i += 2) {
+                p[i] = lo;
+                p[i + 1] = hi;
+            }
+            ram_written(X, n);
+            busy(n, MEM_BYTES_PER_STEP);
+            break;
+        }
+        case MEM_CMP:
+            n = min(block_size(X, Y), block_size(F, Y));
+            check_random(X, n);
+            check_random(F, n);
+            Y = compare(&ram[X], &ram[F], n);
+            ram_reading(X, min((size_t) Y + 1, n));    // up to the first difference
+            ram_reading(F, min((size_t) Y + 1, n));
+            busy(n, MEM_BYTES_PER_STEP);
+            break;
+        case MEM_FIND: {
+            n = block_size(X, Y);
+            check_random(X, n);
+            const uint8_t* found = memchr(&ram[X], F & 0xff, n);
+            Y = found ? (reg_t) (found - &ram[X]) : n;
+            ram_reading(X, min((size_t) Y + 1, n));
+            busy(n, MEM_BYTES_PER_STEP);
+            break;
+        }
+        case MEM_CRC:
+            n = block_size(X, Y);
+            check_random(X, n);
+            ram_reading(X, n);
+            Y = crc16(&ram[X], n);
+            busy(n, CRC_BYTES_PER_STEP);
             break;
         default:
             break;
@@ -78,6 +248,7 @@ static void memory_manager(uint16_t command)
 void
 cpu_init()
 {
+    cpu_set_random_seed((uint64_t) time(NULL) ^ (uintptr_t) current_machine);
     cpu_reset();
 }
 
@@ -86,6 +257,9 @@ cpu_destroy()
 {
     debug_free(dbg);
     dbg = NULL;
+#if JIT
+    jit_destroy();
+#endif
 }
 
 void
@@ -94,7 +268,9 @@ cpu_reset()
     _cpu_error = CPU_ERROR_NO_ERROR;
     memset(reg, 0, sizeof(reg));  // reset registers
     cpu_set_hardware_fpointer(DEV_MEM_MGR, memory_manager);
+    cpu_flush_code_cache();
     skip_next = false;
+    stall_steps = 0;
     memset(&ints, 0, sizeof(Interrupts));
     for (size_t i = 0; i < 256; ++i)
         ints.vector[i] = NO_INTERRUPT;
@@ -107,6 +283,30 @@ cpu_reset()
     PC = 0;
 }
 
+void
+cpu_snapshot(Snapshot* s)
+{
+    memcpy(s->cpu.registers, reg, sizeof s->cpu.registers);
+    s->cpu.interrupts = ints;
+    s->cpu.random = random_state;
+    s->cpu.skip = skip_next;
+    s->cpu.error = _cpu_error;
+    s->cpu.stall = stall_steps;
+}
+
+// The memory must be restored first (see ram_restore), as it flushes the decoded instructions.
+void
+cpu_restore(const Snapshot* s)
+{
+    memcpy(reg, s->cpu.registers, sizeof reg);
+    ints = s->cpu.interrupts;
+    random_state = s->cpu.random;
+    skip_next = s->cpu.skip;
+    _cpu_error = s->cpu.error;
+    stall_steps = s->cpu.stall;
+    break_next = false;
+}
+
 // }}}
 
 // {{{ information
@@ -140,147 +340,210 @@ cpu_register_name(uint8_t idx)
 
 // {{{ parameter parsing
 
-typedef enum {
-    NO_PARAMETER, DIRECT, INDIRECT, INDIRECT_WORD, REGISTER,
-} ParameterType;
-
 typedef struct Parameter {
     uint16_t      dest;
     uint16_t      value;
     ParameterType type;
-    int16_t       sum;
 #ifdef SUPPORT_DEBUG
     char          debug[30];
 #endif
 } Parameter;
 
-inline static reg_t
-fetch_par(reg_t pc, Parameter* p)
+// operand byte classes
+enum {
+    NEXT_V8             = 0x8a,
+    NEXT_V16            = 0x8b,
+    ADDR_NEXT_V8        = 0x8c,
+    ADDR_NEXT_V8_WORD   = 0x8d,
+    ADDR_NEXT_V16       = 0x8e,
+    ADDR_NEXT_V16_WORD  = 0x8f,
+    REG                 = 0x90,
+    ADDR_REG            = 0xa0,
+    ADDR_REG_WORD       = 0xb0,
+    ADDR_REG_V8         = 0xc0,
+    ADDR_REG_V8_WORD    = 0xd0,
+    ADDR_REG_V16        = 0xe0,
+    ADDR_REG_V16_WORD   = 0xf0,
+
+    LITERAL_VALUE_NEG_MAX = 0x7f,
+    LITERAL_VALUE_POS_MAX = 0x3f,
+    LITERAL_ABS_MASK      = 0b00111111,
+    NREGS                 = 16,
+};
+
+static inline uint16_t
+word_at(reg_t addr)
 {
-#ifdef SUPPORT_DEBUG
-#  define DEBUG_REG(...) { if (debugging_mode) snprintf(p->debug, sizeof p->debug, __VA_ARGS__); }
-#else
-#  define DEBUG_REG(...)
-#endif
-    static const uint8_t NEXT_V8             = 0x8a,
-                         NEXT_V16            = 0x8b,
-                         ADDR_NEXT_V8        = 0x8c,
-                         ADDR_NEXT_V8_WORD   = 0x8d,
-                         ADDR_NEXT_V16       = 0x8e,
-                         ADDR_NEXT_V16_WORD  = 0x8f,
-                         REG                 = 0x90,
-                         ADDR_REG            = 0xa0,
-                         ADDR_REG_WORD       = 0xb0,
-                         ADDR_REG_V8         = 0xc0,
-                         ADDR_REG_V8_WORD    = 0xd0,
-                         ADDR_REG_V16        = 0xe0,
-                         ADDR_REG_V16_WORD   = 0xf0;
-
-    static const uint8_t LITERAL_VALUE_NEG_MAX = 0x7f,
-                         LITERAL_VALUE_POS_MAX = 0x3f,
-                         LITERAL_ABS_MASK      = 0b00111111,
-                         NREGS                 = 16;
-
-    p->sum = 0;
+    USE_CURRENT_MACHINE();
+    return ram[addr] | (ram[(reg_t) (addr + 1)] << 8);
+}
+
+static uint8_t
+decode_par(reg_t pc, Operand* o)
+{
+    USE_CURRENT_MACHINE();
     uint8_t b8 = ram[pc];
+    uint8_t r = b8 & 0xf;
+    reg_t   next = pc + 1;
+
     if (b8 <= LITERAL_VALUE_POS_MAX) {
-        p->type = DIRECT;
-        p->value = b8;
-        DEBUG_REG("0x%02X", p->value)
-        return pc + 1;
+        *o = (Operand) { DIRECT, NO_REGISTER, b8 };
+        return 1;
     } else if (b8 <= LITERAL_VALUE_NEG_MAX) {
-        p->type = DIRECT;
-        p->value = (b8 & LITERAL_ABS_MASK) | 0xFF00 | ~LITERAL_ABS_MASK;  // only consider then first 6 bits, negate the rest
-        DEBUG_REG("0x%02X", p->value)
-        return pc + 1;
+        // only consider then first 6 bits, negate the rest
+        *o = (Operand) { DIRECT, NO_REGISTER, (b8 & LITERAL_ABS_MASK) | 0xFF00 | (uint8_t) ~LITERAL_ABS_MASK };
+        return 1;
     } else if (b8 == NEXT_V8) {
-        p->type = DIRECT;
-        p->value = ram[pc+1];
-        DEBUG_REG("0x%02X", p->value)
-        return pc + 2;
+        *o = (Operand) { DIRECT, NO_REGISTER, ram[next] };
+        return 2;
     } else if (b8 == NEXT_V16) {
-        p->type = DIRECT;
-        p->value = ram[pc+1] | (ram[pc+2] << 8);
-        DEBUG_REG("0x%04X", p->value)
-        return pc + 3;
+        *o = (Operand) { DIRECT, NO_REGISTER, word_at(next) };
+        return 3;
     } else if (b8 == ADDR_NEXT_V8) {
-        p->type = INDIRECT;
-        p->dest = ram[pc+1];
-        p->value = ram[p->dest];
-        DEBUG_REG("[0x%02X]", p->dest)
-        return pc + 2;
+        *o = (Operand) { INDIRECT, NO_REGISTER, ram[next] };
+        return 2;
     } else if (b8 == ADDR_NEXT_V8_WORD) {
-        p->type = INDIRECT_WORD;
-        p->dest = ram[pc+1];
-        p->value = ram[p->dest] | (ram[p->dest+1] << 8);
-        DEBUG_REG("^[0x%02X]", p->dest)
-        return pc + 2;
+        *o = (Operand) { INDIRECT_WORD, NO_REGISTER, ram[next] };
+        return 2;
     } else if (b8 == ADDR_NEXT_V16) {
-        p->type = INDIRECT;
-        p->dest = ram[pc+1] | (ram[pc+2] << 8);
-        p->value = ram[p->dest];
-        DEBUG_REG("[0x%04X]", p->dest)
-        return pc + 3;
+        *o = (Operand) { INDIRECT, NO_REGISTER, word_at(next) };
+        return 3;
     } else if (b8 == ADDR_NEXT_V16_WORD) {
-        p->type = INDIRECT_WORD;
-        p->dest = ram[pc+1] | (ram[pc+2] << 8);
-        p->value = ram[p->dest] | (ram[p->dest+1] << 8);
-        DEBUG_REG("^[0x%04X]", p->dest)
-        return pc + 3;
+        *o = (Operand) { INDIRECT_WORD, NO_REGISTER, word_at(next) };
+        return 3;
     } else if (b8 >= REG && b8 < (REG + NREGS)) {
-        p->type = REGISTER;
-        p->dest = b8 - REG;
-        p->value = reg[b8 - REG];
-        DEBUG_REG("%s", cpu_register_name(p->dest))
-        return pc + 1;
+        *o = (Operand) { REGISTER, r, 0 };
+        return 1;
     } else if (b8 >= ADDR_REG && b8 < (ADDR_REG + NREGS)) {
-        p->type = INDIRECT;
-        p->dest = reg[b8 - ADDR_REG];
-        p->value = ram[p->dest];
-        DEBUG_REG("[%s]", cpu_register_name(b8 - ADDR_REG))
-        return pc + 1;
+        *o = (Operand) { INDIRECT, r, 0 };
+        return 1;
     } else if (b8 >= ADDR_REG_WORD && b8 < (ADDR_REG_WORD + NREGS)) {
-        p->type = INDIRECT_WORD;
-        p->dest = reg[b8 - ADDR_REG_WORD];
-        p->value = ram[p->dest] | (ram[p->dest+1] << 8);
-        DEBUG_REG("[%s]", cpu_register_name(b8 - ADDR_REG_WORD))
-        return pc + 1;
+        *o = (Operand) { INDIRECT_WORD, r, 0 };
+        return 1;
     } else if (b8 >= ADDR_REG_V8 && b8 < (ADDR_REG_V8 + NREGS)) {
-        p->type = INDIRECT;
-        p->sum = ram[pc + 1];
-        p->dest = reg[b8 - ADDR_REG_V8] + p->sum;
-        p->value = ram[p->dest];
-        DEBUG_REG("[%s + 0x%02X]", cpu_register_name(b8 - ADDR_REG_V8), (uint8_t) p->sum)
-        return pc + 2;
+        *o = (Operand) { INDIRECT, r, ram[next] };
+        return 2;
     } else if (b8 >= ADDR_REG_V8_WORD && b8 < (ADDR_REG_V8_WORD + NREGS)) {
-        p->type = INDIRECT_WORD;
-        p->sum = ram[pc + 1];
-        p->dest = reg[b8 - ADDR_REG_V8_WORD] + p->sum;
-        p->value = ram[p->dest] | (ram[p->dest+1] << 8);
-        DEBUG_REG("^[%s + 0x%02X]", cpu_register_name(b8 - ADDR_REG_V8_WORD), (uint8_t) p->sum)
-        return pc + 2;
+        *o = (Operand) { INDIRECT_WORD, r, ram[next] };
+        return 2;
     } else if (b8 >= ADDR_REG_V16 && b8 < (ADDR_REG_V16 + NREGS)) {
-        p->type = INDIRECT;
-        p->sum = ram[pc + 1] | (ram[pc + 2] << 8);
-        p->dest = reg[b8 - ADDR_REG_V16] + p->sum;
-        p->value = ram[p->dest];
-        DEBUG_REG("[%s + 0x%04X]", cpu_register_name(b8 - ADDR_REG_V16), (uint16_t) p->sum)
-        return pc + 3;
-    } else if (b8 >= ADDR_REG_V16_WORD && b8 < (ADDR_REG_V16_WORD + NREGS)) {
-        p->type = INDIRECT_WORD;
-        p->sum = ram[pc + 1] | (ram[pc + 2] << 8);
-        p->dest = reg[b8 - ADDR_REG_V16_WORD] + p->sum;
-        p->value = ram[p->dest] | (ram[p->dest+1] << 8);
-        DEBUG_REG("^[%s + 0x%04X]", cpu_register_name(b8 - ADDR_REG_V16_WORD), (uint16_t) p->sum)
-        return pc + 3;
+        *o = (Operand) { INDIRECT, r, word_at(next) };
+        return 3;
+    } else if (b8 >= ADDR_REG_V16_WORD) {
+        *o = (Operand) { INDIRECT_WORD, r, word_at(next) };
+        return 3;
     } else {
         abort();
     }
 }
 
+#if PROFILE
+static uint8_t
+operand_mode(uint8_t b8)
+{
+    static const uint8_t by_class[] = {
+        MODE_REG, MODE_ADDR_REG, MODE_ADDR_REG_WORD, MODE_ADDR_REG_V8, MODE_ADDR_REG_V8_WORD,
+        MODE_ADDR_REG_V16, MODE_ADDR_REG_V16_WORD,
+    };
+    switch (b8) {
+        case NEXT_V8:            return MODE_V8;
+        case NEXT_V16:           return MODE_V16;
+        case ADDR_NEXT_V8:       return MODE_ADDR_V8;
+        case ADDR_NEXT_V8_WORD:  return MODE_ADDR_V8_WORD;
+        case ADDR_NEXT_V16:      return MODE_ADDR_V16;
+        case ADDR_NEXT_V16_WORD: return MODE_ADDR_V16_WORD;
+        default:
+            return b8 < NEXT_V8 ? MODE_LITERAL : by_class[(b8 - REG) >> 4];
+    }
+}
+#endif
+
+inline static void
+resolve_par(const Operand* o, Parameter* p)
+{
+    USE_CURRENT_MACHINE();
+    p->type = o->type;
+    switch (o->type) {
+        case DIRECT:
+            p->value = o->value;
+            break;
+        case REGISTER:
+            p->dest = o->r;
+            p->value = reg[o->r];
+            break;
+        case INDIRECT:
+            p->dest = (o->r == NO_REGISTER) ? o->value : (reg_t) (reg[o->r] + o->value);
+            check_random(p->dest, 1);
+            check_watch(p->dest, 1);
+            p->value = ram[p->dest];
+            break;
+        case INDIRECT_WORD:
+            p->dest = (o->r == NO_REGISTER) ? o->value : (reg_t) (reg[o->r] + o->value);
+            check_random(p->dest, 2);
+            check_watch(p->dest, 2);
+            p->value = word_at(p->dest);
+            break;
+        default:
+            break;
+    }
+}
+
+// Writes the operand encoded in `b` in assembly syntax, and returns its size. Only the operand bytes
+// are read, so it also works for instructions that are not in memory anymore (see trace.c).
+static uint8_t
+describe_operand(const uint8_t* b, char* buf, size_t bufsz)
+{
+#define DESCRIBE(sz, ...) { snprintf(buf, bufsz, __VA_ARGS__); return (sz); }
+    uint8_t b8 = b[0];
+    const char* r = cpu_register_name(b8 & 0xf);
+    uint16_t v16 = b[1] | (b[2] << 8);
+
+    if (b8 <= LITERAL_VALUE_POS_MAX)
+        DESCRIBE(1, "0x%02X", b8)
+    else if (b8 <= LITERAL_VALUE_NEG_MAX)
+        DESCRIBE(1, "0x%02X", (b8 & LITERAL_ABS_MASK) | 0xFF00 | (uint8_t) ~LITERAL_ABS_MASK)
+    else if (b8 == NEXT_V8)
+        DESCRIBE(2, "0x%02X", b[1])
+    else if (b8 == NEXT_V16)
+        DESCRIBE(3, "0x%04X", v16)
+    else if (b8 == ADDR_NEXT_V8)
+        DESCRIBE(2, "[0x%02X]", b[1])
+    else if (b8 == ADDR_NEXT_V8_WORD)
+        DESCRIBE(2, "^[0x%02X]", b[1])
+    else if (b8 == ADDR_NEXT_V16)
+        DESCRIBE(3, "[0x%04X]", v16)
+    else if (b8 == ADDR_NEXT_V16_WORD)
+        DESCRIBE(3, "^[0x%04X]", v16)
+    else if (b8 < ADDR_REG)
+        DESCRIBE(1, "%s", r)
+    else if (b8 < ADDR_REG_WORD)
+        DESCRIBE(1, "[%s]", r)
+    else if (b8 < ADDR_REG_V8)
+        DESCRIBE(1, "^[%s]", r)
+    else if (b8 < ADDR_REG_V8_WORD)
+        DESCRIBE(2, "[%s + 0x%02X]", r, b[1])
+    else if (b8 < ADDR_REG_V16)
+        DESCRIBE(2, "^[%s + 0x%02X]", r, b[1])
+    else if (b8 < ADDR_REG_V16_WORD)
+        DESCRIBE(3, "[%s + 0x%04X]", r, v16)
+    else
+        DESCRIBE(3, "^[%s + 0x%04X]", r, v16)
+#undef DESCRIBE
+}
+
+#ifdef SUPPORT_DEBUG
+static void
+describe_par(reg_t pc, Parameter* p)
+{
+    uint8_t b[3] = { ram[pc], ram[(reg_t) (pc + 1)], ram[(reg_t) (pc + 2)] };
+    describe_operand(b, p->debug, sizeof p->debug);
+}
+#endif
+
 inline static void
 set_par(const Parameter* dest, uint16_t value)
 {
+    USE_CURRENT_MACHINE();
     switch (dest->type) {
         case DIRECT:
             break;  // default, ignore
@@ -302,6 +565,7 @@ set_par(const Parameter* dest, uint16_t value)
 static void
 set_par_with_overflow(const Parameter* dest, uint32_t value)
 {
+    USE_CURRENT_MACHINE();
     switch (dest->type) {
         case DIRECT:
             break;  // default, ignore
@@ -322,18 +586,278 @@ set_par_with_overflow(const Parameter* dest, uint32_t value)
 
 // }}}
 
+// {{{ decoded instruction cache
+
+// Decoding an instruction (reading the opcode and finding out the addressing mode of each operand) is
+// the most expensive part of each step, so decoded instructions are kept in a direct-mapped cache
+// indexed by PC. Every memory byte that belongs to a cached instruction is tracked by the memory
+// (see ram_track_code), which calls cpu_invalidate_code when one of them is written, so
+// self-modifying code keeps working.
+
+static const uint8_t n_parameters[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F      
+    0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0 - special / mov
+    2, 2, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 1 - logic
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0,  // 2 - arithmetic
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0,  // 3 - skip
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 4
+    1, 1, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 5 - stack
+    1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 6 - jumps
+    2, 2, 2, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 7 - i/o
+};
+
+// Size of each operand, by its first byte (0: not a valid operand).
+static const uint8_t operand_size[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0 - literals
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 1
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 2
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4 - negative literals
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 2, 2, 3, 3,  // 8 - value / address in the next bytes
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9 - reg
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // A - [reg]
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // B - ^[reg]
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  // C - [reg + v8]
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  // D - ^[reg + v8]
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,  // E - [reg + v16]
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,  // F - ^[reg + v16]
+};
+
+// Size of the instruction at `pc`, from its opcode and the first byte of each operand, without
+// decoding it. Invalid operand bytes are taken as one byte long.
+static reg_t
+instruction_size(reg_t pc)
+{
+    USE_CURRENT_MACHINE();
+    uint8_t op = ram[pc];
+    if (op == 0x63)     // special jmp: 16-bit address follows the opcode
+        return 3;
+    reg_t sz = 1;
+    for (int i = 0; i < n_parameters[op]; ++i) {
+        uint8_t par_sz = operand_size[ram[(reg_t) (pc + sz)]];
+        sz += par_sz ? par_sz : 1;
+    }
+    return sz;
+}
+
+#if !PROFILE      // only needed by the instruction fusion
+// Whether all the operands of the instruction at `pc` can be decoded.
+static bool
+valid_operands(reg_t pc)
+{
+    USE_CURRENT_MACHINE();
+    uint8_t op = ram[pc];
+    reg_t sz = 1;
+    for (int i = 0; op != 0x63 && i < n_parameters[op]; ++i) {
+        uint8_t par_sz = operand_size[ram[(reg_t) (pc + sz)]];
+        if (par_sz == 0)
+            return false;
+        sz += par_sz;
+    }
+    return true;
+}
+#endif
+
+// Decodes the operands of the instruction `op` at `pc`, and returns where the instruction ends.
+static reg_t
+decode_operands(reg_t pc, uint8_t op, Operand par[2], uint8_t* par1_sz)
+{
+    reg_t next = pc + 1;
+    *par1_sz = 0;
+    if (op == 0x63) {  // special jmp: 16-bit address follows the opcode
+        par[0] = (Operand) { DIRECT, NO_REGISTER, word_at(next) };
+        return next + 2;
+    }
+    if (n_parameters[op] >= 1)
+        next += (*par1_sz = decode_par(next, &par[0]));
+    if (n_parameters[op] >= 2)
+        next += decode_par(next, &par[1]);
+    return next;
+}
+
+// {{{ instruction fusion
+
+// The threaded engine executes some common pairs of instructions as one: the first one jumps
+// straight into the second one, which was decoded with it, without going through the dispatch. The
+// first instruction of a pair must always carry on with the next one (it can't jump, skip or raise
+// an interrupt), and so must the second one, which is executed by its usual implementation.
+//
+// The execution histogram counts instructions one by one, so nothing is fused when it's compiled in.
+
+static bool
+is_conditional(uint8_t op)
+{
+    return op >= 0x30 && op <= 0x3f && n_parameters[op] == 2;
+}
+
+#if !PROFILE
+static bool
+fusable_second(uint8_t op)
+{
+    switch (op) {
+        case 0x00: case 0x02:                                           // NOP, MOV
+        case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15: // logic
+        case 0x20: case 0x22: case 0x24: case 0x2a: case 0x2b:          // ADD, SUB, MUL, INC, DEC
+        case 0x50: case 0x51: case 0x52: case 0x53: case 0x56:          // PUSHB, PUSHW, POPB, POPW, POPN
+            return true;
+        default:
+            return false;
+    }
+}
+#endif
+
+static uint8_t
+fuse(DecodedInstruction* in)
+{
+#if PROFILE
+    (void) in;
+    return FUSED_NONE;
+#else
+    USE_CURRENT_MACHINE();
+    FusedPair kind;
+    switch (in->op) {
+        case 0x02:
+            if (in->par[0].type == REGISTER && in->par[0].r == 0xe)
+                return FUSED_NONE;      // MOV PC, ...: that's a jump
+            kind = FUSED_MOV;
+            break;
+        case 0x51: kind = FUSED_PUSHW; break;
+        case 0x53: kind = FUSED_POPW; break;
+        default:
+            if (!is_conditional(in->op))
+                return FUSED_NONE;
+            kind = FUSED_IF_JMP;
+    }
+
+    in->next_op = ram[in->next_pc];
+    if (!valid_operands(in->next_pc))
+        return FUSED_NONE;
+    decode_operands(in->next_pc, in->next_op, in->next_par, &in->next_par1_sz);
+    if (kind == FUSED_IF_JMP) {
+        bool direct_jump = in->next_op == 0x63 || (in->next_op == 0x60 && in->next_par[0].type == DIRECT);
+        if (!direct_jump || in->next_par[0].value == in->next_pc)
+            return FUSED_NONE;          // jumps to themselves must be seen by the idle detection
+    } else if (!fusable_second(in->next_op)) {
+        return FUSED_NONE;
+    }
+    return kind;
+#endif
+}
+
+// }}}
+
+static const DecodedInstruction*
+decode_instruction(reg_t pc)
+{
+    USE_CURRENT_MACHINE();
+    DecodedInstruction* in = &decoded[pc & (DECODE_CACHE_SZ - 1)];
+    if (in->valid && in->pc == pc)
+        return in;
+
+    in->pc = pc;
+    in->op = ram[pc];
+    in->next_pc = decode_operands(pc, in->op, in->par, &in->par1_sz);
+#if PROFILE
+    if (in->op == 0x63) {
+        in->mode[0] = MODE_V16;
+    } else {
+        in->mode[0] = operand_mode(ram[(reg_t) (pc + 1)]);
+        in->mode[1] = operand_mode(ram[(reg_t) (pc + 1 + in->par1_sz)]);
+    }
+#endif
+
+    // conditional instructions and fused pairs depend on the next instruction too
+    in->fused = fuse(in);
+    in->pair_end = in->next_pc;
+    if (in->fused != FUSED_NONE || is_conditional(in->op))
+        in->pair_end += instruction_size(in->next_pc);
+    in->valid = true;
+
+    ram_track_code(pc, (reg_t) (in->pair_end - pc));
+    return in;
+}
+
+const DecodedInstruction*
+cpu_decode_instruction(reg_t pc)
+{
+    return decode_instruction(pc);
+}
+
+void
+cpu_invalidate_code(uint16_t addr)
+{
+    // a decoded instruction might depend on the one after it too (see pair_end)
+    reg_t pc = addr - (2 * MAX_INSTRUCTION_SZ - 1);
+    for (size_t i = 0; i < 2 * MAX_INSTRUCTION_SZ; ++i, ++pc) {
+        DecodedInstruction* in = &decoded[pc & (DECODE_CACHE_SZ - 1)];
+        if (in->valid && in->pc == pc && (reg_t) (addr - pc) < (reg_t) (in->pair_end - pc))
+            in->valid = false;
+    }
+#if JIT
+    jit_invalidate(addr);
+#endif
+}
+
+void
+cpu_flush_code_cache()
+{
+    for (size_t i = 0; i < DECODE_CACHE_SZ; ++i)
+        decoded[i].valid = false;
+#if JIT
+    jit_flush();
+#endif
+}
+
+// }}}
+
 // {{{ interrupts
 
+// Must be called whenever the queue, `active` or `happening` change, so the CPU only has to look
+// at `pending` on each step.
+static inline void
+update_pending()
+{
+    ints.pending = ints.active && !ints.happening && ints.queue_len > 0;
+}
+
 void
 cpu_interrupt(uint8_t number, uint16_t xt_value)
 {
-    if (ints.active && ints.vector[number] != NO_INTERRUPT && ints.queue_idx < 0xFF) {
-        ints.queue[ints.queue_idx] = (QueuedInterrupt) { .interrupt = number, .xt_value = xt_value };
-        ++ints.queue_idx;
+    if (ints.active && ints.vector[number] != NO_INTERRUPT) {
+        if (ints.queue_len == INTERRUPT_QUEUE_SZ) {
+            ++ints.overflows;
+            return;
+        }
+        uint16_t tail = (ints.queue_head + ints.queue_len) & (INTERRUPT_QUEUE_SZ - 1);
+        ints.queue[tail] = (QueuedInterrupt) { .interrupt = number, .xt_value = xt_value };
+        ++ints.queue_len;
         ints.waiting = false;
+        update_pending();
     }
 }
 
+uint64_t
+cpu_fused_steps()
+{
+    return fused_steps;
+}
+
+uint64_t
+cpu_idle_steps()
+{
+    return idle_steps;
+}
+
+uint32_t
+cpu_interrupt_overflows()
+{
+    return ints.overflows;
+}
+
 __attribute__((unused)) bool
 cpu_waiting_for_interrupt()
 {
@@ -343,10 +867,11 @@ cpu_waiting_for_interrupt()
 static QueuedInterrupt
 check_for_interrupt()
 {
-    if (ints.active && !ints.happening && ints.queue_idx > 0) {
-        QueuedInterrupt interrupt = ints.queue[0];   // get interrupt
-        memmove(&ints.queue[0], &ints.queue[1], 0xfe * sizeof(ints.queue[0]));  // remove from queue
-        --ints.queue_idx;
+    if (ints.pending) {
+        QueuedInterrupt interrupt = ints.queue[ints.queue_head];
+        ints.queue_head = (ints.queue_head + 1) & (INTERRUPT_QUEUE_SZ - 1);
+        --ints.queue_len;
+        update_pending();
         return interrupt;
     }
     return (QueuedInterrupt) { .interrupt = NO_INTERRUPT };
@@ -356,6 +881,7 @@ static uint16_t
 enter_interrupt(uint8_t number)
 {
     ints.happening = true; // set as happening
+    update_pending();
     ints.ret_addr = PC; // save return address
     PC = ints.vector[number];
     return PC;
@@ -365,6 +891,7 @@ static uint16_t
 leave_interrupt()
 {
     ints.happening = false;
+    update_pending();
     PC = ints.ret_addr;
     return PC;
 }
@@ -384,344 +911,444 @@ cpu_set_hardware_fpointer(uint8_t hw, void(*fptr)(__attribute__((unused)) uint16
 // {{{ instruction execution
 
 static int
-cpu_execute_instruction(uint8_t op, const Parameter* par1, const Parameter* par2, __attribute__((unused)) char** op_name)
+invalid_instruction(__attribute__((unused)) uint8_t op)
+{
+    --PC;
+#if !TESTING
+    fprintf(stderr, "Invalid CPU operation 0x%02X in PC 0x%X.\n", op, PC);
+#endif
+    _cpu_error = CPU_ERROR_INVALID_OPCODE;
+    return PC;
+}
+
+// Skips the instruction after `in`. It's done right away, unless the skipped instruction needs to
+// show up in the trace: then cpu_step goes through it (see step).
+static inline void
+skip(const DecodedInstruction* in)
+{
+    USE_CURRENT_MACHINE();
+    if (tracing)
+        skip_next = true;
+    else
+        PC = in->pair_end;
+}
+
+static int
+cpu_execute_instruction(const DecodedInstruction* in, const Parameter* par1, const Parameter* par2, __attribute__((unused)) char** op_name)
 {
 #ifdef SUPPORT_DEBUG
-#define SET_OP_NAME(op_str) {*op_name=(op_str);}
+#  define INSTRUCTION(code, name) case code: *op_name = (name);
 #else
-#define SET_OP_NAME(op_str)
+#  define INSTRUCTION(code, name) case code:
 #endif
+#define NEXT                break
+#define LEAVE               break
+#define SKIP_NEXT_IF(cond)  { if (cond) skip(in); } break
+#define JUMP(addr)          { PC = (addr); } break
+#define DEBUGGER()          return DEBUGGER_REQUESTED
 
-    // execute instruction
-    switch (op) {
-    case 0x0:  // NOP
-        SET_OP_NAME("NOP")
-        break;
-    case 0x1:  // DBG
-        SET_OP_NAME("DBG")
-        return DEBUGGER_REQUESTED;
-    case 0x2:  // MOV
-        SET_OP_NAME("MOV")
-        set_par(par1, par2->value);
-        break;
-
-    case 0x10:  // OR
-        SET_OP_NAME("OR")
-        set_par(par1, par1->value | par2->value);
-        break;
-    case 0x11:  // AND
-        SET_OP_NAME("AND")
-        set_par(par1, par1->value & par2->value);
-        break;
-    case 0x12:  // XOR
-        SET_OP_NAME("XOR")
-        set_par(par1, par1->value ^ par2->value);
-        break;
-    case 0x13:  // SHL
-        SET_OP_NAME("SHL")
-        set_par_with_overflow(par1, ((uint32_t) par1->value) << par2->value);
-        break;
-    case 0x14:  // SHR
-        SET_OP_NAME("SHR")
-        set_par(par1, par1->value >> par2->value);
-        break;
-    case 0x15:  // NOT
-        SET_OP_NAME("NOT")
-        set_par(par1, ~par1->value);
-        break;
+    USE_CURRENT_MACHINE();
 
-    case 0x20:  // ADD
-        SET_OP_NAME("ADD")
-        set_par_with_overflow(par1, par1->value + par2->value);
-        break;
-    case 0x22:  // SUB
-        SET_OP_NAME("SUB")
-        set_par_with_overflow(par1, par1->value - par2->value);
-        break;
-    case 0x24:  // MUL
-        SET_OP_NAME("MUL")
-        set_par_with_overflow(par1, par1->value * par2->value);
-        break;
-    case 0x26:  // DIV
-        SET_OP_NAME("DIV")
-        if (par2->value == 0)
-            cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
-        else
-            set_par(par1, par1->value / par2->value);
-        break;
-    case 0x27:  // DIV$
-        SET_OP_NAME("DIV$")
-        if (par2->value == 0)
-            cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
-        else
-            set_par(par1, par1->value / (int16_t)par2->value);
-        break;
-    case 0x29:  // MOD
-        SET_OP_NAME("MOD")
-        if (par2->value == 0)
-            cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
-        else
-            set_par(par1, par1->value % par2->value);
-        break;
-    case 0x2a:  // INC
-        SET_OP_NAME("INC")
-        set_par_with_overflow(par1, par1->value + 1);
-        break;
-    case 0x2b:  // DEC
-        SET_OP_NAME("DEC")
-            set_par_with_overflow(par1, par1->value - 1);
-            break;
+    // execute instruction
+    switch (in->op) {
+#include "instructions.h"
+    default:
+        return invalid_instruction(in->op);
+    }
+    return PC;
 
-    case 0x30: // IFNE
-        SET_OP_NAME("IFNE")
-        if (par1->value == par2->value)
-            skip_next = true;
-        break;
-    case 0x31: // IFEQ
-        SET_OP_NAME("IFEQ")
-        if (par1->value != par2->value)
-            skip_next = true;
-        break;
-    case 0x32: // IFGT
-        SET_OP_NAME("IFGT")
-        if (par1->value <= par2->value)
-            skip_next = true;
-        break;
-    case 0x33: // IFGT$
-        SET_OP_NAME("IFGT$")
-        if ((int16_t) par1->value <= (int16_t) par2->value)
-            skip_next = true;
-        break;
-    case 0x35: // IFLT
-        SET_OP_NAME("IFLT")
-        if (par1->value >= par2->value)
-            skip_next = true;
-        break;
-    case 0x36: // IFLT$
-        SET_OP_NAME("IFLT$")
-        if ((int16_t) par1->value >= (int16_t) par2->value)
-            skip_next = true;
-        break;
-    case 0x38: // IFGE
-        SET_OP_NAME("IFGE")
-        if (par1->value < par2->value)
-            skip_next = true;
-        break;
-    case 0x39: // IFGE$
-        SET_OP_NAME("IFGE$")
-        if ((int16_t) par1->value < (int16_t) par2->value)
-            skip_next = true;
-        break;
-    case 0x3C: // IFLE
-        SET_OP_NAME("IFLE")
-        if (par1->value > par2->value)
-            skip_next = true;
-        break;
-    case 0x3D: // IFLE$
-        SET_OP_NAME("IFLE$")
-        if ((int16_t) par1->value > (int16_t) par2->value)
-            skip_next = true;
-        break;
+#undef INSTRUCTION
+#undef NEXT
+#undef LEAVE
+#undef SKIP_NEXT_IF
+#undef JUMP
+#undef DEBUGGER
+}
 
-#define PUSH16(n) { ram_set_bypass(SP--, ((n) >> 8) & 0xff); ram_set_bypass(SP--, (n) & 0xff); }
-#define POP16() (SP += 2, ram[SP-1] | (ram[SP] << 8))
-    case 0x50: // PUSHB
-        SET_OP_NAME("PUSHB")
-        ram_set_bypass(SP--, par1->value);
-        break;
-    case 0x51: // PUSHW
-        SET_OP_NAME("PUSHW")
-        PUSH16(par1->value)
-        break;
-    case 0x52: // POPB
-        SET_OP_NAME("POPB")
-        set_par(par1, ram[++SP]);
-        break;
-    case 0x53: // POPW
-        SET_OP_NAME("POP16")
-        set_par(par1, POP16());
-        break;
-    case 0x54: // PUSHA
-        SET_OP_NAME("PUSHA")
-        PUSH16(A)
-        PUSH16(B)
-        PUSH16(C)
-        PUSH16(D)
-        PUSH16(E)
-        PUSH16(F)
-        PUSH16(I)
-        PUSH16(J)
-        PUSH16(K)
-        PUSH16(X)
-        PUSH16(Y)
-        PUSH16(FP)
-        PUSH16(OV)
-        break;
-    case 0x55: // POPA
-        SET_OP_NAME("POPA")
-        OV = POP16();
-        FP = POP16();
-        Y = POP16();
-        X = POP16();
-        K = POP16();
-        J = POP16();
-        I = POP16();
-        F = POP16();
-        E = POP16();
-        D = POP16();
-        C = POP16();
-        B = POP16();
-        A = POP16();
-        break;
-    case 0x56: // POPN
-        SET_OP_NAME("POPN")
-        SP += par1->value;
-        break;
-#undef PUSH16
-#undef POP16
+// }}}
 
-    case 0x60: // JMP
-        SET_OP_NAME("JMP")
-        PC = par1->value;
-        break;
-    case 0x61: // JSR
-        SET_OP_NAME("JSR")
-        ram_set_bypass(SP--, PC >> 8);  // push next instruction PC onto stack
-        ram_set_bypass(SP--, PC & 0xff);
-        PC = par1->value;
-        break;
-    case 0x62: // RET
-        SET_OP_NAME("RET")
-        PC = ram[++SP];
-        PC |= ram[++SP] << 8;
-        break;
+// {{{ execution histogram
 
-    case 0x70: // DEV
-        SET_OP_NAME("DEV")
-        if (hw_fptr[par1->value & 0xff])
-            hw_fptr[par1->value & 0xff](par2->value & 0xffff);
-        break;
-    case 0x71: // IVEC
-        SET_OP_NAME("IVEC")
-        ints.vector[par1->value & 0xff] = par2->value;
-        break;
-    case 0x72: // INT
-        SET_OP_NAME("INT")
-        cpu_interrupt(par1->value & 0xff, par2->value);
-        break;
-    case 0x73: // IRET
-        SET_OP_NAME("IRET")
-        if (ints.happening)
-            leave_interrupt();
-        else
-            cpu_interrupt(INT_CPU, XT_CPU_IRET);
-        break;
-    case 0x74: // WAIT
-        SET_OP_NAME("WAIT")
-        ints.waiting = true;
-        break;
-    case 0x75: // IENAB
-        SET_OP_NAME("IENAB")
-        ints.active = par1->value & 1;
-        break;
+#if PROFILE
+#  define profile (current_machine->profile)    // see profile.c
+#  define PROFILE_COUNT(in) profile_count(in)
 
-    default:
-        --PC;
-#if !TESTING
-        fprintf(stderr, "Invalid CPU operation 0x%02X in PC 0x%X.\n", op, PC);
-#endif
-        _cpu_error = CPU_ERROR_INVALID_OPCODE;
-        return PC;
+static inline void
+profile_count(const DecodedInstruction* in)
+{
+    USE_CURRENT_MACHINE();
+    ++profile.opcodes[in->op];
+    if (profile.any_op)
+        ++profile.sequences[profile.last_op][in->op];
+    profile.last_op = in->op;
+    profile.any_op = true;
+    for (int i = 0; i < n_parameters[in->op]; ++i) {
+        ++profile.modes[in->mode[i]];
+        ++profile.pairs[in->op][i][in->mode[i]];
     }
-    return PC;
-#undef SET_OP_NAME
 }
+#else
+#  define PROFILE 0
+#  define PROFILE_COUNT(in)
+#endif
 
 // }}}
 
 // {{{ step
 
-static const uint8_t n_parameters[256] = {
-//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F      
-    0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0 - special / mov
-    2, 2, 2, 2, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 1 - logic
-    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0,  // 2 - arithmetic
-    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0,  // 3 - skip
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 4
-    1, 1, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 5 - stack
-    1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 6 - jumps
-    2, 2, 2, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 7 - i/o
-};
-
 static __attribute__((unused)) void cpu_print_debug(reg_t pc, char* op, Parameter* par1, Parameter* par2);
 
+static int step();
+
+// Executes a single instruction, leaving a trace record of it (see trace.c).
+static int
+traced_instruction()
+{
+    USE_CURRENT_MACHINE();
+    TraceRecord* t = trace_begin(ints.pending ? TRACE_INTERRUPT : skip_next ? TRACE_SKIPPED : 0);
+    reg_t before[16];
+    memcpy(before, reg, sizeof before);
+    int ret = step();
+    trace_end(t, before);
+    return ret;
+}
+
 int
 cpu_step()
 {
-    _cpu_error = CPU_ERROR_NO_ERROR;
+    USE_CURRENT_MACHINE();
+    if (stall_steps > 0) {    // still busy with a device command
+        --stall_steps;
+        if (tracing)
+            trace_count(1);
+        return PC;
+    }
+    if (tracing) {
+        int ret = PC;
+        if (!ints.waiting) {
+            ret = traced_instruction();
+            if (skip_next)
+                traced_instruction();
+        }
+        trace_count(1);
+        return ret;
+    }
 
-    __attribute__((unused)) reg_t original_pc = PC;
+    int ret = step();
+    if (skip_next)
+        step();     // the skipped instruction is part of the same step
+    return ret;
+}
 
-    // set random
-    int r = rand();   // NOLINT
-    ram[CPU_RANDOM] = r & 0xff;
-    ram[CPU_RANDOM+1] = (r >> 8) & 0xff;
+static int
+step()
+{
+    USE_CURRENT_MACHINE();
+    _cpu_error = CPU_ERROR_NO_ERROR;
+
+    reg_t original_pc = PC;
 
     // waiting for interrupts?
     if (ints.waiting)
         return PC;
 
     // check for interrupts
-    QueuedInterrupt interrupt = check_for_interrupt();
-    if (interrupt.interrupt != NO_INTERRUPT) {
+    if (ints.pending) {
+        QueuedInterrupt interrupt = check_for_interrupt();
         XT = interrupt.xt_value;
         return enter_interrupt(interrupt.interrupt);
     }
 
+    // skip next? (only when tracing, see skip; the instruction is not even decoded, so a skipped
+    // instruction never reads CPU_RANDOM)
+    if (skip_next) {
+        skip_next = false;
+        PC += instruction_size(PC);
+        return PC;
+    }
+
     // read next instruction
-    uint8_t op = ram[PC++];
+    const DecodedInstruction* in = decode_instruction(PC);
+    uint8_t op = in->op;
 
     // deal with special jmp case
     if (op == 0x63) {
-        uint16_t next = ram[PC++];
-        next |= ram[PC++] << 8;
-        if (skip_next)
-            skip_next = false;
-        else
-            PC = next;
+        PROFILE_COUNT(in);
+        PC = in->par[0].value;
         return PC;
     }
 
-    // read parameters
-    Parameter par1 = {}, par2 = {};
-    if (n_parameters[op] >= 1)
-        PC = fetch_par(PC, &par1); // dest
-    if (n_parameters[op] >= 2)
-        PC = fetch_par(PC, &par2); // origin
-
     // break next?
     if (break_next) {
-        bkps_set_tmp_brk(PC);
+        bkps_set_tmp_brk(in->next_pc);
         break_next = false;
     }
-    
-    // skip next?
-    if (skip_next) {
-        skip_next = false;
-        return PC;
+    PROFILE_COUNT(in);
+
+    // read parameters
+    Parameter par1 = {}, par2 = {};
+    PC = original_pc + 1;
+    if (n_parameters[op] >= 1)
+        resolve_par(&in->par[0], &par1); // dest
+    PC += in->par1_sz;
+    if (n_parameters[op] >= 2)
+        resolve_par(&in->par[1], &par2); // origin
+    PC = in->next_pc;
+#ifdef SUPPORT_DEBUG
+    if (debugging_mode) {
+        if (n_parameters[op] >= 1)
+            describe_par(original_pc + 1, &par1);
+        if (n_parameters[op] >= 2)
+            describe_par(original_pc + 1 + in->par1_sz, &par2);
     }
+#endif
 
     char* op_str = NULL;
-    int ret = cpu_execute_instruction(op, &par1, &par2, &op_str);
+    int ret = cpu_execute_instruction(in, &par1, &par2, &op_str);
 #if !__EMSCRIPTEN__
     if (debugging_mode)
         cpu_print_debug(original_pc, op_str, &par1, &par2);
 #endif
-    if (skip_next)
-        cpu_step();
     return ret;
 }
 
+// }}}
+
+// {{{ run
+
+// cpu_run executes up to `steps` steps, and returns how many were executed. It returns early on a
+// CPU error, and right after a WAIT (unless the CPU was already waiting when it was called).
+//
+// When the CPU becomes idle, nothing can change until an interrupt arrives, and interrupts only
+// arrive from outside cpu_run. So the remaining steps are not executed at all: cpu_run returns as
+// if they were, and the emulator moves on to the next event (end of frame, timers).
+
+// The CPU is idle when it's waiting for an interrupt, or stuck in a jump to itself.
+static bool
+cpu_idle()
+{
+    if (skip_next || break_next || debugging_mode || ints.pending || stall_steps)
+        return false;
+    if (ints.waiting)
+        return true;
+    const DecodedInstruction* in = decode_instruction(PC);
+    return (in->op == 0x63 || (in->op == 0x60 && in->par[0].type == DIRECT)) && in->par[0].value == PC;
+}
+
+// Skips the remaining steps of an idle CPU (`n` out of `steps` were executed).
+static int
+fast_forward(int steps, int n)
+{
+    if (tracing)
+        trace_count(steps - n);
+    idle_steps += (uint64_t) (steps - n);
+    return steps;
+}
+
+#if JIT
+
+// JIT engine: translated blocks (see jit.c) run whenever nothing else needs the CPU attention, and
+// the interpreter executes every instruction that couldn't be translated. Translated blocks don't
+// update the execution histogram, so everything is interpreted when it's compiled in.
+
+int
+cpu_run(int steps)
+{
+    bool was_waiting = ints.waiting;
+    int n = 0;
+    while (n < steps) {
+        if (ints.waiting && !was_waiting)
+            break;
+        reg_t pc = PC;
+        if (!(PROFILE || ints.waiting || skip_next || break_next || debugging_mode || tracing || ints.pending || stall_steps)) {
+            int executed = jit_run(reg, steps - n);
+            if (executed > 0) {
+                _cpu_error = CPU_ERROR_NO_ERROR;
+                n += executed;
+                if (executed == 1 && PC == pc && cpu_idle())
+                    return fast_forward(steps, n);
+                continue;
+            }
+        }
+        cpu_step();
+        ++n;
+        if (_cpu_error != CPU_ERROR_NO_ERROR)
+            break;
+        if (PC == pc && cpu_idle())
+            return fast_forward(steps, n);
+    }
+    return n;
+}
+
+#elif THREADED_DISPATCH
+
+#ifndef __GNUC__
+#  error "THREADED_DISPATCH requires a compiler with support for labels as values (GCC, Clang)."
+#endif
+
+// Threaded engine: each instruction jumps straight into the implementation of the next one, going
+// back to the loop only when the step budget is over, or when something happened that needs the
+// full cpu_step treatment (queued interrupt, wait, debugging, error...).
+
+int
+cpu_run(int steps)
+{
+#define INSTRUCTION(code, name) op_##code:
+#define NEXT                    DISPATCH()
+#define LEAVE                   goto leave
+#define SKIP_NEXT_IF(cond)      { if (cond) goto skip; if (in->fused) goto if_jmp; } DISPATCH()
+#define JUMP(addr)              { PC = (addr); if (PC == in->pc) goto leave; } DISPATCH()
+#define DEBUGGER()              goto leave
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void* const dispatch[256] = {
+        [0 ... 255] = &&invalid,
+        [0x0]  = &&op_0x0,  [0x1]  = &&op_0x1,  [0x2]  = &&op_0x2,
+        [0x10] = &&op_0x10, [0x11] = &&op_0x11, [0x12] = &&op_0x12, [0x13] = &&op_0x13, [0x14] = &&op_0x14,
+        [0x15] = &&op_0x15,
+        [0x20] = &&op_0x20, [0x22] = &&op_0x22, [0x24] = &&op_0x24, [0x26] = &&op_0x26, [0x27] = &&op_0x27,
+        [0x29] = &&op_0x29, [0x2a] = &&op_0x2a, [0x2b] = &&op_0x2b,
+        [0x30] = &&op_0x30, [0x31] = &&op_0x31, [0x32] = &&op_0x32, [0x33] = &&op_0x33, [0x35] = &&op_0x35,
+        [0x36] = &&op_0x36, [0x38] = &&op_0x38, [0x39] = &&op_0x39, [0x3C] = &&op_0x3C, [0x3D] = &&op_0x3D,
+        [0x50] = &&op_0x50, [0x51] = &&op_0x51, [0x52] = &&op_0x52, [0x53] = &&op_0x53, [0x54] = &&op_0x54,
+        [0x55] = &&op_0x55, [0x56] = &&op_0x56,
+        [0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&special_jmp,
+        [0x70] = &&op_0x70, [0x71] = &&op_0x71, [0x72] = &&op_0x72, [0x73] = &&op_0x73, [0x74] = &&op_0x74,
+        [0x75] = &&op_0x75,
+    };
+    static const void* const fused_dispatch[] = {
+        [FUSED_MOV] = &&fused_mov, [FUSED_PUSHW] = &&fused_pushw, [FUSED_POPW] = &&fused_popw,
+    };
+#pragma GCC diagnostic pop
+
+    USE_CURRENT_MACHINE();
+    int n = 0;
+    const DecodedInstruction* in = NULL;
+    Parameter p1 = {}, p2 = {};
+    const Parameter* par1 = &p1;
+    const Parameter* par2 = &p2;
+
+#define DISPATCH() {                                \
+        if (n == steps)                             \
+            goto leave;                             \
+        ++n;                                        \
+        reg_t pc = PC;                              \
+        in = decode_instruction(pc);                \
+        PROFILE_COUNT(in);                          \
+        PC = pc + 1;                                \
+        if (n_parameters[in->op] >= 1)              \
+            resolve_par(&in->par[0], &p1);          \
+        PC += in->par1_sz;                          \
+        if (n_parameters[in->op] >= 2)              \
+            resolve_par(&in->par[1], &p2);          \
+        PC = in->next_pc;                           \
+        if (in->fused > FUSED_IF_JMP)               \
+            goto *fused_dispatch[in->fused];        \
+        goto *dispatch[in->op];                     \
+    }
+
+    // second instruction of a fused pair, unless the first one ran out of steps or overwrote it
+#define FUSED_NEXT() {                              \
+        if (n == steps || !in->valid)               \
+            DISPATCH();                             \
+        ++n;                                        \
+        ++fused_steps;                              \
+        PC = in->next_pc + 1;                       \
+        if (n_parameters[in->next_op] >= 1)         \
+            resolve_par(&in->next_par[0], &p1);     \
+        PC += in->next_par1_sz;                     \
+        if (n_parameters[in->next_op] >= 2)         \
+            resolve_par(&in->next_par[1], &p2);     \
+        PC = in->pair_end;                          \
+        goto *dispatch[in->next_op];                \
+    }
+
+    bool was_waiting = ints.waiting;
+    while (n < steps) {
+        if (ints.waiting && !was_waiting)
+            break;
+        if (ints.waiting || skip_next || break_next || debugging_mode || tracing || ints.pending || stall_steps) {
+            reg_t pc = PC;
+            cpu_step();
+            ++n;
+            if (_cpu_error != CPU_ERROR_NO_ERROR)
+                break;
+            if (PC == pc && cpu_idle())
+                return fast_forward(steps, n);
+            continue;
+        }
+
+        _cpu_error = CPU_ERROR_NO_ERROR;
+        DISPATCH();
+
+#include "instructions.h"
+
+special_jmp:
+        JUMP(par1->value);
+skip:
+        PC = in->pair_end;
+        NEXT;
+
+        // fused pairs (see fuse)
+if_jmp:
+        if (n == steps || !in->valid)
+            DISPATCH();
+        ++n;
+        ++fused_steps;
+        PC = in->next_par[0].value;
+        DISPATCH();
+fused_mov:
+        set_par(par1, par2->value);
+        FUSED_NEXT();
+fused_pushw:
+        ram_set_bypass(SP--, (par1->value >> 8) & 0xff);
+        ram_set_bypass(SP--, par1->value & 0xff);
+        FUSED_NEXT();
+fused_popw:
+        SP += 2;
+        set_par(par1, ram[(reg_t) (SP - 1)] | (ram[SP] << 8));
+        FUSED_NEXT();
+invalid:
+        invalid_instruction(in->op);
+        break;
+leave:
+        if (n < steps && in && PC == in->pc && cpu_idle())
+            return fast_forward(steps, n);
+    }
+    return n;
+
+#undef DISPATCH
+#undef FUSED_NEXT
+#undef INSTRUCTION
+#undef NEXT
+#undef LEAVE
+#undef SKIP_NEXT_IF
+#undef JUMP
+#undef DEBUGGER
+}
+
+#else
+
+int
+cpu_run(int steps)
+{
+    bool was_waiting = ints.waiting;
+    int n = 0;
+    while (n < steps) {
+        reg_t pc = PC;
+        cpu_step();
+        ++n;
+        if (_cpu_error != CPU_ERROR_NO_ERROR || (ints.waiting && !was_waiting))
+            break;
+        if (PC == pc && cpu_idle())
+            return fast_forward(steps, n);
+    }
+    return n;
+}
+
+#endif
+
 long
 cpu_addr_from_source(const char* filename, size_t line)
 {
@@ -738,6 +1365,12 @@ cpu_break_next()
     break_next = true;
 }
 
+bool
+cpu_breaking_next()
+{
+    return break_next;
+}
+
 bool
 cpu_next_is_subroutine()
 {
@@ -814,11 +1447,12 @@ found:
             PRINT("%s\"%zu\":%d", comma++ ? "," : "", i, ints.vector[i])
     PRINT("},")
     PRINT("\"queuedInterrupts\":[")
-    for (int i = 0; i < ints.queue_idx; ++i) {
-        PRINT("{\"interrupt\":%d,\"xtValue\":%d}%s", 
-                ints.queue[i].interrupt, ints.queue[i].xt_value, (i != (ints.queue_idx - 1)) ? "," : "")
+    for (int i = 0; i < ints.queue_len; ++i) {
+        const QueuedInterrupt* q = &ints.queue[(ints.queue_head + i) & (INTERRUPT_QUEUE_SZ - 1)];
+        PRINT("{\"interrupt\":%d,\"xtValue\":%d}%s", q->interrupt, q->xt_value, (i != (ints.queue_len - 1)) ? "," : "")
     }
     PRINT("],")
+    PRINT("\"queueOverflows\":%u,", ints.overflows)
     PRINT("\"active\":%s,", ints.active ? "true" : "false")
     PRINT("\"happening\":%s,", ints.happening ? "true" : "false")
     PRINT("\"returnAddress\":%d", ints.ret_addr)
@@ -829,6 +1463,55 @@ found:
     return n;
 }
 
+static const char* const instruction_names[256] = {
+    [0x0]  = "NOP",   [0x1]  = "DBG",   [0x2]  = "MOV",
+    [0x10] = "OR",    [0x11] = "AND",   [0x12] = "XOR",   [0x13] = "SHL",   [0x14] = "SHR",
+    [0x15] = "NOT",
+    [0x20] = "ADD",   [0x22] = "SUB",   [0x24] = "MUL",   [0x26] = "DIV",   [0x27] = "DIV$",
+    [0x29] = "MOD",   [0x2a] = "INC",   [0x2b] = "DEC",
+    [0x30] = "IFNE",  [0x31] = "IFEQ",  [0x32] = "IFGT",  [0x33] = "IFGT$", [0x35] = "IFLT",
+    [0x36] = "IFLT$", [0x38] = "IFGE",  [0x39] = "IFGE$", [0x3C] = "IFLE",  [0x3D] = "IFLE$",
+    [0x50] = "PUSHB", [0x51] = "PUSHW", [0x52] = "POPB",  [0x53] = "POP16", [0x54] = "PUSHA",
+    [0x55] = "POPA",  [0x56] = "POPN",
+    [0x60] = "JMP",   [0x61] = "JSR",   [0x62] = "RET",   [0x63] = "JMP",
+    [0x70] = "DEV",   [0x71] = "IVEC",  [0x72] = "INT",   [0x73] = "IRET",  [0x74] = "WAIT",
+    [0x75] = "IENAB",
+};
+
+const char*
+cpu_instruction_name(uint8_t op)
+{
+    return instruction_names[op] ? instruction_names[op] : "invalid";
+}
+
+int
+cpu_disassemble(const uint8_t* bytes, char* buf, size_t bufsz)
+{
+    uint8_t op = bytes[0];
+    if (!instruction_names[op]) {
+        snprintf(buf, bufsz, "??? 0x%02X", op);
+        return 1;
+    }
+    if (op == 0x63) {  // special jmp
+        snprintf(buf, bufsz, "JMP 0x%04X", bytes[1] | (bytes[2] << 8));
+        return 3;
+    }
+
+    char par1[30], par2[30];
+    int sz = 1;
+    if (n_parameters[op] == 0) {
+        snprintf(buf, bufsz, "%s", instruction_names[op]);
+    } else if (n_parameters[op] == 1) {
+        sz += describe_operand(&bytes[sz], par1, sizeof par1);
+        snprintf(buf, bufsz, "%s %s", instruction_names[op], par1);
+    } else {
+        sz += describe_operand(&bytes[sz], par1, sizeof par1);
+        sz += describe_operand(&bytes[sz], par2, sizeof par2);
+        snprintf(buf, bufsz, "%s %s, %s", instruction_names[op], par1, par2);
+    }
+    return sz;
+}
+
 static void
 cpu_disassemble_instruction(char* buf, int bufsz, char* op, Parameter *par1, Parameter *par2)
 {
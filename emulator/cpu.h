@@ -9,6 +9,8 @@
 
 typedef uint16_t reg_t;
 
+typedef struct Snapshot Snapshot;
+
 #define DEBUGGER_REQUESTED -0x100
 
 typedef enum {
@@ -19,10 +21,17 @@ typedef enum {
 void        cpu_init();
 void        cpu_destroy();
 void        cpu_reset();
+void        cpu_snapshot(Snapshot* s);
+void        cpu_restore(const Snapshot* s);
 
 int         cpu_step();
+int         cpu_run(int steps);
+uint64_t    cpu_fused_steps();      // steps executed as the second half of a fused pair (see decode.h)
+uint64_t    cpu_idle_steps();       // steps skipped, not executed, because the CPU was idle (see cpu_run)
 void        cpu_interrupt(uint8_t number, uint16_t xt_value);
+uint32_t    cpu_interrupt_overflows();
 void        cpu_set_hardware_fpointer(uint8_t hw, void(*fptr)(uint16_t data));
+void        cpu_set_random_seed(uint64_t seed);
 bool        cpu_waiting_for_interrupt();
 bool        cpu_next_is_subroutine();
 
@@ -32,11 +41,17 @@ reg_t       cpu_register(uint8_t idx);
 void        cpu_set_debugging_mode(bool v);
 void        cpu_load_debugging_info(const DebuggingInfo* dbg);
 int         cpu_dbg_json(char* buf, size_t bufsz);
+const char* cpu_instruction_name(uint8_t op);
+int         cpu_disassemble(const uint8_t* bytes, char* buf, size_t bufsz);   // returns the instruction size
 CpuError    cpu_error();
 
 long        cpu_addr_from_source(const char* filename, size_t line);
 
+void        cpu_invalidate_code(uint16_t addr);
+void        cpu_flush_code_cache();
+
 void        cpu_break_next();
+bool        cpu_breaking_next();
 
 #define cpu_A()  cpu_register(0x0)
 #define cpu_B()  cpu_register(0x1)
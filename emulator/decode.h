@@ -0,0 +1,58 @@
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+typedef enum {
+    NO_PARAMETER, DIRECT, INDIRECT, INDIRECT_WORD, REGISTER,
+} ParameterType;
+
+#define NO_REGISTER         0xff
+#define MAX_INSTRUCTION_SZ  7        // opcode + 2 * (operand byte + 16-bit value)
+#define DECODE_CACHE_SZ     0x1000
+
+// Pairs of instructions that the threaded engine executes as one (see cpu.c). The profiler counts
+// which instructions follow which (see profile.h), which is how these were chosen.
+typedef enum {
+    FUSED_NONE,
+    FUSED_IF_JMP,       // IFxx, then JMP to a fixed address: jumps straight from the condition
+    FUSED_MOV,          // MOV, then one of the simple instructions (see fusable_second in cpu.c)
+    FUSED_PUSHW,        // PUSHW, then a simple instruction (usually PUSHW or POPW)
+    FUSED_POPW,         // POPW, then a simple instruction (usually POPW)
+} FusedPair;
+
+// An operand with its addressing mode already resolved. The value is only read when the
+// instruction is executed, as registers and memory might have changed since it was decoded.
+typedef struct Operand {
+    uint8_t  type;    // ParameterType
+    uint8_t  r;       // register (REGISTER) or base register for indirect addressing (or NO_REGISTER)
+    uint16_t value;   // literal value (DIRECT), or address/offset (INDIRECT, INDIRECT_WORD)
+} Operand;
+
+typedef struct DecodedInstruction {
+    reg_t   pc;
+    reg_t   next_pc;
+    uint8_t op;
+    uint8_t par1_sz;
+    bool    valid;
+    Operand par[2];
+    reg_t   pair_end;       // where the next instruction ends (to skip it, or in a fused pair)
+    uint8_t fused;          // FusedPair
+    uint8_t next_op;        // the next instruction, already decoded, when fused
+    uint8_t next_par1_sz;
+    Operand next_par[2];
+#if PROFILE
+    uint8_t mode[2];    // OperandMode, see profile.h
+#endif
+} DecodedInstruction;
+
+// The returned instruction lives in the CPU decode cache, and is only valid until the next
+// instruction that maps to the same cache entry is decoded.
+const DecodedInstruction* cpu_decode_instruction(reg_t pc);
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
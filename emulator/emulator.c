@@ -3,21 +3,30 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <string.h>
 
 #include "breakpoints.h"
 #include "cpu.h"
+#include "framebuffer.h"
+#include "history.h"
 #include "joystick.h"
+#include "machinestate.h"
 #include "memory.h"
+#include "recorder.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "snapshot.h"
 #include "timer.h"
+#include "trace.h"
 #include "video.h"
 
-#define STEPS_PER_FRAME 64800     // 4 Mhz   (3.88 Mhz)
-
-static bool execution_suspended = false;
-static bool end_of_frame = false;
-static int steps_left = STEPS_PER_FRAME;
-static void (*breakpoint_hit_fptr)() = NULL;
-static bool break_at_end_of_frame = false;
+// emulator state, in the machine currently selected (see machine.h)
+#define execution_suspended    (current_machine->emulator.execution_suspended)
+#define end_of_frame           (current_machine->emulator.end_of_frame)
+#define breakpoint_hit_fptr    (current_machine->emulator.breakpoint_hit_fptr)
+#define break_at_end_of_frame  (current_machine->emulator.break_at_end_of_frame)
+#define frame_count            (current_machine->emulator.frame_count)
+#define headless               (current_machine->emulator.headless)
 
 void
 emulator_init(bool reset_memory)
@@ -29,8 +38,17 @@ emulator_init(bool reset_memory)
     cpu_init();
     timer_init();
 #ifndef HEADLESS
-    video_init();
+    if (!headless)
+        video_init();
+    else
 #endif
+        framebuffer_reset();    // no window, but the video memory is the same
+}
+
+void
+emulator_set_headless(bool v)
+{
+    headless = v;
 }
 
 void
@@ -38,24 +56,70 @@ emulator_reset()
 {
     execution_suspended = false;
     end_of_frame = false;
-    steps_left = STEPS_PER_FRAME;
+    emulator_set_frame_position(0);
+}
+
+// {{{ events
+
+static void
+frame_finished()
+{
+    replay_frame_input_begin();
+#ifndef HEADLESS
+    if (!headless)
+        video_tick();
+#endif
+    replay_frame_input_end();
+    ++frame_count;
+    end_of_frame = true;
+    scheduler_add(SCHED_END_OF_FRAME, scheduler_now() + STEPS_PER_FRAME);
 }
 
+// Runs the events due by now (see scheduler.h). Returns true if the frame ended; the state is then
+// saved in the rewind history, after all the events of the frame.
+static bool
+run_events()
+{
+    bool frame_ended = false;
+    for (int kind; (kind = scheduler_pop_due()) >= 0; ) {
+        switch (kind) {
+            case SCHED_END_OF_FRAME:
+                frame_finished();
+                frame_ended = true;
+                break;
+            case SCHED_TIMERS:
+                timer_frame_step();
+                scheduler_add(SCHED_TIMERS, scheduler_now() + STEPS_PER_FRAME);
+                break;
+        }
+    }
+    if (frame_ended) {
+        history_push();
+        recorder_frame();
+    }
+    return frame_ended;
+}
+
+// steps until the next event, at most `cycles`
+static int
+until_next_event(int cycles)
+{
+    uint64_t due = scheduler_next() - scheduler_now();
+    return due < (uint64_t) cycles ? (int) due : cycles;
+}
+
+// }}}
+
 CpuError
 emulator_step()
 {
     end_of_frame = false;
+    bkps_watch_triggered();     // forget the hits while nobody was looking
     cpu_step();
-    --steps_left;
+    scheduler_advance(1);
 
     // is it the end of frame?
-    if (steps_left == 0) {
-#ifndef HEADLESS
-        video_tick();
-#endif
-        timer_frame_step();
-        steps_left = STEPS_PER_FRAME;
-        end_of_frame = true;
+    if (run_events()) {
 
         // was is supposed to break at the end of the frame?
         if (breakpoint_hit_fptr && break_at_end_of_frame) {
@@ -65,8 +129,8 @@ emulator_step()
         }
     }    
     
-    // check for breakpoint hit
-    if (breakpoint_hit_fptr && bkps_is_addr(cpu_PC())) {
+    // check for breakpoint or watchpoint hit
+    if (breakpoint_hit_fptr && (bkps_is_addr(cpu_PC()) || bkps_watch_triggered())) {
         breakpoint_hit_fptr();
         end_of_frame = true;
     }
@@ -77,26 +141,107 @@ emulator_step()
 CpuError
 emulator_frame()
 {
-    // size_t t = SDL_GetTicks();
-    for (;;) {
-        CpuError e = emulator_step();
-        if (e != CPU_ERROR_NO_ERROR)
-            return e;
-        if (end_of_frame)
-            break;
+    emulator_run_cycles(STEPS_PER_FRAME - emulator_frame_position(), EMULATOR_STOP_END_OF_FRAME | EMULATOR_STOP_BREAKPOINT);
+    return cpu_error();
+}
+
+// Runs `steps` steps checking for breakpoints and watchpoints after each one. Returns the number of
+// steps executed, and sets `hit` if it stopped on one of them.
+static int
+run_with_breakpoints(int steps, unsigned stop_mask, bool* hit)
+{
+    bkps_watch_triggered();     // forget the hits while nobody was looking
+    for (int n = 0; n < steps; ) {
+        cpu_step();
+        ++n;
+        if (cpu_error() != CPU_ERROR_NO_ERROR)
+            return n;
+        if (bkps_is_addr(cpu_PC()) || bkps_watch_triggered()) {
+            *hit = true;
+            return n;
+        }
+        if ((stop_mask & EMULATOR_STOP_WAIT) && cpu_waiting_for_interrupt())
+            return n;
+    }
+    return steps;
+}
+
+EmulatorStop
+emulator_run_cycles(int cycles, unsigned stop_mask)
+{
+    end_of_frame = false;
+
+    while (cycles > 0) {
+        if ((stop_mask & EMULATOR_STOP_WAIT) && cpu_waiting_for_interrupt())
+            return EMULATOR_STOP_WAIT;
+
+        // breakpoints are only checked after each step while there's any to check; otherwise, the
+        // CPU runs freely until the next event
+        int chunk = until_next_event(cycles);
+        bool hit = false;
+        int executed;
+        if ((stop_mask & EMULATOR_STOP_BREAKPOINT) && breakpoint_hit_fptr && (bkps_armed() || cpu_breaking_next()))
+            executed = run_with_breakpoints(chunk, stop_mask, &hit);
+        else
+            executed = cpu_run(chunk);
+        cycles -= executed;
+        scheduler_advance(executed);
+
+        if (run_events()) {
+            if (breakpoint_hit_fptr && break_at_end_of_frame && (stop_mask & EMULATOR_STOP_BREAKPOINT)) {
+                breakpoint_hit_fptr();
+                break_at_end_of_frame = false;
+                return EMULATOR_STOP_BREAKPOINT;
+            }
+        }
+        if (cpu_error() != CPU_ERROR_NO_ERROR)
+            return EMULATOR_STOP_ERROR;
+        if (hit) {
+            breakpoint_hit_fptr();
+            end_of_frame = true;
+            return EMULATOR_STOP_BREAKPOINT;
+        }
+        if (end_of_frame && (stop_mask & EMULATOR_STOP_END_OF_FRAME))
+            return EMULATOR_STOP_END_OF_FRAME;
     }
-    // printf("%zu\n", SDL_GetTicks() - t);
-    return CPU_ERROR_NO_ERROR;
+    return EMULATOR_STOP_NONE;
 }
 
 void
 emulator_destroy()
 {
 #if !HEADLESS
-    video_destroy();
+    if (!headless)
+        video_destroy();
 #endif
     cpu_destroy();
+    framebuffer_free();
     bkps_clear();
+    trace_stop();
+    history_stop();
+    replay_stop();
+    recorder_stop();
+}
+
+uint64_t
+emulator_cycles()
+{
+    return scheduler_now();
+}
+
+int
+emulator_frame_position()
+{
+    return STEPS_PER_FRAME - (int) (scheduler_when(SCHED_END_OF_FRAME) - scheduler_now());
+}
+
+// The frame timers are updated in the same cycle the frame ends.
+void
+emulator_set_frame_position(int steps)
+{
+    uint64_t end = scheduler_now() + (uint64_t) (STEPS_PER_FRAME - steps);
+    scheduler_add(SCHED_END_OF_FRAME, end);
+    scheduler_add(SCHED_TIMERS, end);
 }
 
 void
@@ -107,6 +252,7 @@ emulator_load_rom(const char* filename)
     while(!feof(f))
         pos += fread(&ram[pos], 1, 1024, f);
     fclose(f);
+    cpu_flush_code_cache();
 }
 
 void
@@ -125,6 +271,29 @@ emulator_soft_reset()
     video_reset();
 }
 
+void
+emulator_snapshot(Snapshot* s)
+{
+    memcpy(s->magic, "RLSS", sizeof s->magic);
+    s->version = SNAPSHOT_VERSION;
+    s->size = sizeof(Snapshot);
+    s->frame_steps = STEPS_PER_FRAME - emulator_frame_position();
+    cpu_snapshot(s);
+    memcpy(s->memory, ram, sizeof s->memory);
+}
+
+int
+emulator_restore(const Snapshot* s)
+{
+    if (!snapshot_valid(s))
+        return -1;
+    ram_restore(s->memory);
+    cpu_restore(s);
+    emulator_set_frame_position(STEPS_PER_FRAME - s->frame_steps);
+    end_of_frame = false;
+    return 0;
+}
+
 void
 emulator_suspend_execution()
 {
@@ -3,20 +3,43 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "cpu.h"
+#include "snapshot.h"
+
+#define STEPS_PER_FRAME 64800     // 4 Mhz   (3.88 Mhz)
 
 typedef void(*BreakpointListener)();
 
+// Why emulator_run_cycles stopped. The same flags are used in its `stop_mask`, to choose which
+// events stop the run (errors always do).
+typedef enum {
+    EMULATOR_STOP_NONE          = 0,        // all the cycles were executed
+    EMULATOR_STOP_END_OF_FRAME  = 1 << 0,
+    EMULATOR_STOP_BREAKPOINT    = 1 << 1,   // the breakpoint listener was called
+    EMULATOR_STOP_ERROR         = 1 << 2,
+    EMULATOR_STOP_WAIT          = 1 << 3,   // the CPU is waiting for an interrupt
+} EmulatorStop;
+
 void emulator_init(bool reset_memory);
+void emulator_set_headless(bool headless);     // before emulator_init: run without a window
 CpuError emulator_step();
 CpuError emulator_frame();
+EmulatorStop emulator_run_cycles(int cycles, unsigned stop_mask);
 void emulator_destroy();
 
+uint64_t emulator_cycles();     // steps executed since the machine was created
+int  emulator_frame_position();                // steps already executed in the current frame
+void emulator_set_frame_position(int steps);
+
 void emulator_load_rom(const char* file);
 void emulator_hard_reset();
 void emulator_soft_reset();
 
+void emulator_snapshot(Snapshot* s);
+int  emulator_restore(const Snapshot* s);      // -1 if the snapshot is invalid (see snapshot_valid)
+
 void emulator_suspend_execution();
 void emulator_set_break_at_eof();
 void emulator_bkp_hit_set_fptr(BreakpointListener bkp_fptr);
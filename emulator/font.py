@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+
+# Bakes font.bmp into a C header with one bit per pixel: for each character, one byte per row, the
+# leftmost pixel in bit 5. White pixels are part of the glyph; black ones are background (a few of
+# them are not transparent in the image, but they only ever showed as black). Character `c` is in
+# column c / 16, row c % 16 of the image.
+
+import struct
+import sys
+
+CHAR_W = 6
+CHAR_H = 9
+
+
+def main():
+    filename = sys.argv[1] if len(sys.argv) > 1 else 'font.bmp'
+    with open(filename, 'rb') as f:
+        data = f.read()
+    offset = struct.unpack_from('<I', data, 10)[0]
+    w, h, _, bpp = struct.unpack_from('<iiHH', data, 18)
+    if bpp != 8:
+        sys.exit('%s: only 8 bit images are supported' % filename)
+    header_sz = struct.unpack_from('<I', data, 14)[0]
+    palette = data[14 + header_sz:offset]
+    stride = (w + 3) & ~3
+    bottom_up = h > 0
+    h = abs(h)
+
+    def lit(x, y):
+        row = (h - 1 - y) if bottom_up else y
+        idx = data[offset + row * stride + x]
+        return palette[idx * 4:idx * 4 + 3] != b'\0\0\0'     # BGR
+
+    print('// generated from font.bmp by font.py - do not edit')
+    print()
+    print('static const uint8_t font_bits[256][%d] = {' % CHAR_H)
+    for c in range(256):
+        ox, oy = (c // 16) * CHAR_W, (c % 16) * CHAR_H
+        rows = []
+        for y in range(CHAR_H):
+            bits = 0
+            for x in range(CHAR_W):
+                if lit(ox + x, oy + y):
+                    bits |= 1 << (CHAR_W - 1 - x)
+            rows.append('0x%02x' % bits)
+        print('    { %s },' % ', '.join(rows))
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,369 @@
+#include "framebuffer.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "font_bits.h"
+#include "machinestate.h"
+#include "memory.h"
+#include "mmap.h"
+
+// framebuffer state, in the machine currently selected (see machine.h)
+#define pixels        (current_machine->framebuffer.pixels)
+#define dirty         (current_machine->framebuffer.dirty)
+#define all_dirty     (current_machine->framebuffer.all_dirty)
+#define cursor        (current_machine->framebuffer.cursor)
+#define cursor_color  (current_machine->framebuffer.cursor_color)
+
+#define LINES     30
+#define COLUMNS   40
+#define CHAR_W     6
+#define CHAR_H     9
+
+#define TEXT_W    (COLUMNS * CHAR_W)
+
+void
+framebuffer_reset()
+{
+#define SET_COLOR(n, color) \
+    ram[VIDEO_PALETTE + (n * 3)] = (color >> 16) & 0xff; \
+    ram[VIDEO_PALETTE + (n * 3) + 1] = (color >> 8) & 0xff; \
+    ram[VIDEO_PALETTE + (n * 3) + 2] = color & 0xff;
+
+    // palette - https://lospec.com/palette-list/sweetie-16
+    SET_COLOR(COLOR_BLACK,      0x1a1c2c)
+    SET_COLOR(COLOR_PURPLE,     0x5d275d)
+    SET_COLOR(COLOR_RED,        0xb13e53)
+    SET_COLOR(COLOR_ORANGE,     0xef7d57)
+    SET_COLOR(COLOR_YELLOW,     0xffcd75)
+    SET_COLOR(COLOR_LIME,       0xa7f070)
+    SET_COLOR(COLOR_GREEN,      0x38b764)
+    SET_COLOR(COLOR_TURQUOISE,  0x257179)
+    SET_COLOR(COLOR_DARK_BLUE,  0x29366f)
+    SET_COLOR(COLOR_BLUE,       0x3b5dc9)
+    SET_COLOR(COLOR_LIGHT_BLUE, 0x41a6f6)
+    SET_COLOR(COLOR_CYAN,       0x73eff7)
+    SET_COLOR(COLOR_WHITE,      0xf4f4f4)
+    SET_COLOR(COLOR_LIGHT_GRAY, 0x94b0c2)
+    SET_COLOR(COLOR_GRAY,       0x566c86)
+    SET_COLOR(COLOR_DARK_GRAY,  0x333c57)
+#undef SET_COLOR
+
+    // text color
+    memset(&ram[VIDEO_TXT_COLOR], (COLOR_LIME << 4) | COLOR_BLACK, LINES * COLUMNS);
+    ram[VIDEO_CURSOR_INFO] = (1 << 4) | COLOR_ORANGE;  // visible, whole, non-blinking, orange
+    framebuffer_invalidate();
+}
+
+// {{{ dirty cells
+
+static void
+mark(int cell)
+{
+    dirty[cell / 64] |= (uint64_t) 1 << (cell % 64);
+}
+
+static bool
+is_dirty(int cell)
+{
+    return dirty[cell / 64] & ((uint64_t) 1 << (cell % 64));
+}
+
+void
+framebuffer_touch(uint16_t addr)
+{
+    if (addr >= VIDEO_TXT && addr < VIDEO_TXT + FRAMEBUFFER_CELLS)
+        mark(addr - VIDEO_TXT);
+    else if (addr >= VIDEO_TXT_COLOR && addr < VIDEO_TXT_COLOR + FRAMEBUFFER_CELLS)
+        mark(addr - VIDEO_TXT_COLOR);
+    else if (addr == VIDEO_BORDER || addr >= VIDEO_PALETTE)
+        all_dirty = true;
+    // the cursor is compared with the one drawn, in framebuffer_update
+}
+
+void
+framebuffer_invalidate()
+{
+    all_dirty = true;
+}
+
+// Marks the cells where the cursor was and is now, if it changed since it was drawn.
+static void
+check_cursor()
+{
+    uint8_t info = ram[VIDEO_CURSOR_INFO];
+    uint16_t pos = ram_get16(VIDEO_CURSOR_POS);
+    int32_t now = ((info >> 4) & 1) && pos < FRAMEBUFFER_CELLS ? pos : -1;
+    if (now == cursor && (info & 0xf) == cursor_color)
+        return;
+    if (cursor >= 0)
+        mark(cursor);
+    if (now >= 0)
+        mark(now);
+    cursor = now;
+    cursor_color = info & 0xf;
+}
+
+// }}}
+
+// {{{ drawing
+
+static uint32_t
+palette_color(uint8_t idx)
+{
+    const uint8_t* c = &ram[VIDEO_PALETTE + (idx & 0xf) * 3];
+    return 0xff000000u | ((uint32_t) c[0] << 16) | ((uint32_t) c[1] << 8) | c[2];
+}
+
+static void
+fill(uint32_t* dest, size_t n, uint32_t color)
+{
+    for (size_t i = 0; i < n; ++i)
+        dest[i] = color;
+}
+
+// Expands one row of a glyph (see font.py) into pixels. There are no branches, so the compiler can
+// turn each row into a few vector selects.
+static inline void
+draw_glyph_row(uint32_t* dest, uint8_t bits, uint32_t fg, uint32_t bg)
+{
+    uint32_t diff = fg ^ bg;
+    for (int x = 0; x < CHAR_W; ++x) {
+        uint32_t mask = -(uint32_t) ((bits >> (CHAR_W - 1 - x)) & 1);
+        dest[x] = bg ^ (diff & mask);
+    }
+}
+
+static void
+draw_border(uint32_t color)
+{
+    fill(pixels, FRAMEBUFFER_BORDER * FRAMEBUFFER_W, color);
+    for (int y = FRAMEBUFFER_BORDER; y < FRAMEBUFFER_H - FRAMEBUFFER_BORDER; ++y) {
+        uint32_t* row = &pixels[y * FRAMEBUFFER_W];
+        fill(row, FRAMEBUFFER_BORDER, color);
+        fill(&row[FRAMEBUFFER_BORDER + TEXT_W], FRAMEBUFFER_BORDER, color);
+    }
+    fill(&pixels[(FRAMEBUFFER_H - FRAMEBUFFER_BORDER) * FRAMEBUFFER_W], FRAMEBUFFER_BORDER * FRAMEBUFFER_W, color);
+}
+
+static void
+draw_cell(int cell, const uint32_t* palette)
+{
+    uint8_t color = ram[VIDEO_TXT_COLOR + cell];
+    uint8_t c = ram[VIDEO_TXT + cell];
+    uint32_t fg = palette[color >> 4];
+    uint32_t bg = palette[color & 0xf];
+    if (cell == cursor) {
+        fg = bg;
+        bg = palette[cursor_color];
+    }
+    const uint8_t* glyph = font_bits[(c == ' ') ? 0 : c];
+
+    uint32_t* dest = &pixels[(FRAMEBUFFER_BORDER + (cell / COLUMNS) * CHAR_H) * FRAMEBUFFER_W
+                             + FRAMEBUFFER_BORDER + (cell % COLUMNS) * CHAR_W];
+    for (int y = 0; y < CHAR_H; ++y)
+        draw_glyph_row(&dest[y * FRAMEBUFFER_W], glyph[y], fg, bg);
+}
+
+bool
+framebuffer_update()
+{
+    if (!pixels) {
+        pixels = malloc(FRAMEBUFFER_W * FRAMEBUFFER_H * sizeof(uint32_t));
+        if (!pixels)
+            return false;
+        all_dirty = true;
+    }
+    check_cursor();
+
+    uint32_t palette[16];
+    for (uint8_t i = 0; i < 16; ++i)
+        palette[i] = palette_color(i);
+
+    bool changed = all_dirty;
+    if (all_dirty)
+        draw_border(palette[ram[VIDEO_BORDER] & 0xf]);
+    for (int word = 0; word < (int) (sizeof dirty / sizeof dirty[0]); ++word) {
+        if (!all_dirty && dirty[word] == 0)
+            continue;
+        for (int cell = word * 64; cell < (word + 1) * 64 && cell < FRAMEBUFFER_CELLS; ++cell) {
+            if (all_dirty || is_dirty(cell)) {
+                draw_cell(cell, palette);
+                changed = true;
+            }
+        }
+    }
+    memset(dirty, 0, sizeof dirty);
+    all_dirty = false;
+    return changed;
+}
+
+const uint32_t*
+framebuffer_pixels()
+{
+    return pixels;
+}
+
+void
+framebuffer_free()
+{
+    free(pixels);
+    pixels = NULL;
+}
+
+// }}}
+
+// {{{ text and images
+
+size_t
+framebuffer_text(char* buf)
+{
+    size_t n = 0;
+    for (int line = 0; line < LINES; ++line) {
+        for (int column = 0; column < COLUMNS; ++column) {
+            char c = (char) ram[VIDEO_TXT + line * COLUMNS + column];
+            buf[n++] = (c == 0) ? ' ' : c;
+        }
+        buf[n++] = '\n';
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static void
+put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t
+crc32(uint32_t crc, const uint8_t* data, size_t sz)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < sz; ++i) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void
+write_chunk(FILE* f, const char* type, const uint8_t* data, size_t sz)
+{
+    uint8_t header[8];
+    put32(header, (uint32_t) sz);
+    memcpy(&header[4], type, 4);
+    uint8_t crc[4];
+    put32(crc, crc32(crc32(0, (const uint8_t*) type, 4), data, sz));
+    fwrite(header, 1, sizeof header, f);
+    fwrite(data, 1, sz, f);
+    fwrite(crc, 1, sizeof crc, f);
+}
+
+// RGB rows, each one starting with a filter byte (none)
+#define ROW_SZ    (1 + FRAMEBUFFER_W * 3)
+#define RAW_SZ    (ROW_SZ * FRAMEBUFFER_H)
+#define BLOCK_SZ  0xffff
+
+// PNG, without compression: the image data is a zlib stream made of stored blocks, so there's no
+// need for zlib.
+static int
+write_png(FILE* f, const uint8_t* rgb)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof signature, f);
+
+    uint8_t ihdr[13] = { 0 };
+    put32(&ihdr[0], FRAMEBUFFER_W);
+    put32(&ihdr[4], FRAMEBUFFER_H);
+    ihdr[8] = 8;        // bits per channel
+    ihdr[9] = 2;        // RGB
+    write_chunk(f, "IHDR", ihdr, sizeof ihdr);
+
+    size_t n_blocks = (RAW_SZ + BLOCK_SZ - 1) / BLOCK_SZ;
+    uint8_t* idat = malloc(2 + RAW_SZ + n_blocks * 5 + 4);
+    if (!idat)
+        return -1;
+    size_t n = 0;
+    idat[n++] = 0x78;   // deflate, 32K window
+    idat[n++] = 0x01;
+    uint32_t a = 1, b = 0;  // adler-32
+    for (size_t pos = 0; pos < RAW_SZ; pos += BLOCK_SZ) {
+        uint16_t len = (RAW_SZ - pos < BLOCK_SZ) ? (uint16_t) (RAW_SZ - pos) : BLOCK_SZ;
+        idat[n++] = (pos + len == RAW_SZ);     // last block?
+        idat[n++] = len & 0xff;
+        idat[n++] = len >> 8;
+        idat[n++] = ~len & 0xff;
+        idat[n++] = (~len >> 8) & 0xff;
+        memcpy(&idat[n], &rgb[pos], len);
+        n += len;
+        for (size_t i = pos; i < pos + len; ++i) {
+            a = (a + rgb[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    put32(&idat[n], (b << 16) | a);
+    n += 4;
+    write_chunk(f, "IDAT", idat, n);
+    free(idat);
+    write_chunk(f, "IEND", NULL, 0);
+    return 0;
+}
+
+static bool
+has_extension(const char* filename, const char* ext)
+{
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(&filename[len - ext_len], ext) == 0;
+}
+
+int
+framebuffer_save(const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+
+    int r = 0;
+    if (has_extension(filename, ".txt")) {
+        char text[FRAMEBUFFER_TEXT_SZ];
+        fwrite(text, 1, framebuffer_text(text), f);
+    } else {
+        framebuffer_update();
+        uint8_t* rgb = pixels ? malloc(RAW_SZ) : NULL;
+        if (rgb) {
+            uint8_t* p = rgb;
+            for (int y = 0; y < FRAMEBUFFER_H; ++y) {
+                *p++ = 0;   // PNG filter, ignored for PPM
+                for (int x = 0; x < FRAMEBUFFER_W; ++x) {
+                    uint32_t px = pixels[y * FRAMEBUFFER_W + x];
+                    *p++ = px >> 16;
+                    *p++ = px >> 8;
+                    *p++ = px;
+                }
+            }
+            if (has_extension(filename, ".png")) {
+                r = write_png(f, rgb);
+            } else {
+                fprintf(f, "P6\n%d %d\n255\n", FRAMEBUFFER_W, FRAMEBUFFER_H);
+                for (int y = 0; y < FRAMEBUFFER_H; ++y)
+                    fwrite(&rgb[y * ROW_SZ + 1], 1, ROW_SZ - 1, f);
+            }
+            free(rgb);
+        } else {
+            r = -1;
+        }
+    }
+    if (ferror(f))
+        r = -1;
+    if (fclose(f) != 0)
+        r = -1;
+    return r;
+}
+
+// }}}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
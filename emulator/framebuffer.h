@@ -0,0 +1,41 @@
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Software renderer: draws the screen (border, text, colors and cursor) from the video memory into
+// a framebuffer of ARGB8888 pixels, with the font baked in at build time (see font.py). It doesn't
+// depend on SDL, so it also works without a window. Each machine has its own framebuffer.
+//
+// The framebuffer is the whole window at zoom 1: the 40x30 cells of 6x9 pixels, and a 10 pixel
+// border around them.
+//
+// Only the cells that changed since the last frame are drawn again. The memory writes to the video
+// memory mark them (see framebuffer_touch); a change to the border or the palette redraws
+// everything.
+//
+// It's also the video of headless machines: framebuffer_text and framebuffer_save show what the
+// program displays without a window.
+
+#define FRAMEBUFFER_BORDER  10
+#define FRAMEBUFFER_W       (40 * 6 + FRAMEBUFFER_BORDER * 2)
+#define FRAMEBUFFER_H       (30 * 9 + FRAMEBUFFER_BORDER * 2)
+#define FRAMEBUFFER_CELLS   (40 * 30)
+#define FRAMEBUFFER_TEXT_SZ (30 * (40 + 1) + 1)
+
+bool            framebuffer_update();       // draws what changed; false if nothing did
+const uint32_t* framebuffer_pixels();       // FRAMEBUFFER_W * FRAMEBUFFER_H, NULL until the first update
+void            framebuffer_invalidate();   // everything is drawn again in the next update
+void            framebuffer_free();
+void            framebuffer_reset();        // sets the palette, text colors and cursor to their defaults
+
+size_t          framebuffer_text(char* buf);    // FRAMEBUFFER_TEXT_SZ: 30 lines of 40 characters, '\n' after each
+int             framebuffer_save(const char* filename);     // PNG (*.png), text (*.txt) or PPM
+
+void            framebuffer_touch(uint16_t addr);   // called after a write to the video memory
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -7,6 +7,7 @@
 #include "cpu.h"
 #include "emulator.h"
 #include "memory.h"
+#include "replay.h"
 #include "video.h"
 #include "../compiler/output.h"
 #include "mmap.h"
@@ -127,15 +128,15 @@ load_output(Output* output)
 int EMSCRIPTEN_KEEPALIVE
 send_keypress(uint16_t key)
 {
-    cpu_interrupt(INT_KEYBOARD, key);
+    replay_input_interrupt(INT_KEYBOARD, key);
     return 0;
 }
 
 int EMSCRIPTEN_KEEPALIVE
 set_joystick(uint8_t state)
 {
-    cpu_interrupt(INT_JOYSTICK, state);
-    ram[JOYSTICK_STATE] = state;
+    replay_input_interrupt(INT_JOYSTICK, state);
+    replay_input_ram(JOYSTICK_STATE, state);
     return 0;
 }
 
@@ -156,6 +157,18 @@ swap_breakpoint(const char* filename, size_t line)
     return bkps_swap(filename, line);
 }
 
+int EMSCRIPTEN_KEEPALIVE
+add_watchpoint(uint16_t start, uint16_t end, uint8_t kinds)
+{
+    return bkps_watch_add(start, end, kinds);
+}
+
+bool EMSCRIPTEN_KEEPALIVE
+remove_watchpoint(uint16_t start, uint16_t end)
+{
+    return bkps_watch_remove(start, end);
+}
+
 int EMSCRIPTEN_KEEPALIVE
 add_breakpoint_listener(intptr_t listener)
 {
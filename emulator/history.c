@@ -0,0 +1,237 @@
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "machinestate.h"
+#include "snapshot.h"
+
+// history state, in the machine currently selected (see machine.h)
+#define ring            (current_machine->history.ring)         // encoded frames
+#define ring_sz         (current_machine->history.ring_sz)
+#define ring_tail       (current_machine->history.ring_tail)    // where the next frame is written
+#define frames          (current_machine->history.frames)       // circular, oldest first
+#define max_frames      (current_machine->history.max_frames)
+#define oldest          (current_machine->history.oldest)
+#define n_frames        (current_machine->history.n_frames)
+#define latest          (current_machine->history.latest)       // state of the latest frame pushed
+#define scratch         (current_machine->history.scratch)
+#define encoded         (current_machine->history.encoded)
+#define keyframe_every  (current_machine->history.keyframe_every)
+#define since_keyframe  (current_machine->history.since_keyframe)
+
+// worst case for the encoding below: a 4 byte header for every 4 zeros and 1 literal byte
+#define MAX_ENCODED_SZ  (sizeof(Snapshot) * 2 + 8)
+#define MIN_ZERO_RUN    4
+
+#define FRAME(i)  (&frames[(oldest + (i)) % max_frames])
+
+// {{{ encoding
+
+// Run-length encodes `a ^ b` (or just `a`, if `b` is NULL) as a sequence of blocks, each one a
+// number of zero bytes followed by a number of literal bytes (16 bits each), and then the literals.
+static size_t
+encode(const uint8_t* a, const uint8_t* b, size_t sz, uint8_t* out)
+{
+#define BYTE(i) (b ? (a[i] ^ b[i]) : a[i])
+    size_t n = 0;
+    size_t i = 0;
+    while (i < sz) {
+        uint16_t zeros = 0;
+        while (i < sz && zeros < UINT16_MAX && BYTE(i) == 0)
+            ++zeros, ++i;
+
+        // literals go on until there are enough zeros in a row to be worth a new block
+        size_t start = i;
+        uint16_t literals = 0;
+        while (i < sz && literals < UINT16_MAX - MIN_ZERO_RUN) {
+            size_t z = 0;
+            while (i + z < sz && z < MIN_ZERO_RUN && BYTE(i + z) == 0)
+                ++z;
+            if (z == MIN_ZERO_RUN || i + z == sz)
+                break;
+            literals += z + 1;
+            i += z + 1;
+        }
+
+        memcpy(&out[n], &zeros, 2);
+        memcpy(&out[n + 2], &literals, 2);
+        n += 4;
+        for (size_t j = start; j < start + literals; ++j)
+            out[n++] = BYTE(j);
+    }
+    return n;
+#undef BYTE
+}
+
+// Applies an encoded frame to `dest`: XORs the literals into it if it's a delta, or overwrites it
+// completely if it's a keyframe.
+static void
+decode(const uint8_t* in, size_t in_sz, uint8_t* dest, bool keyframe)
+{
+    size_t n = 0;
+    size_t i = 0;
+    while (n < in_sz) {
+        uint16_t zeros, literals;
+        memcpy(&zeros, &in[n], 2);
+        memcpy(&literals, &in[n + 2], 2);
+        n += 4;
+        if (keyframe)
+            memset(&dest[i], 0, zeros);
+        i += zeros;
+        if (keyframe) {
+            memcpy(&dest[i], &in[n], literals);
+        } else {
+            for (size_t j = 0; j < literals; ++j)
+                dest[i + j] ^= in[n + j];
+        }
+        i += literals;
+        n += literals;
+    }
+}
+
+// }}}
+
+// {{{ ring buffer
+
+static void
+drop_oldest()
+{
+    oldest = (oldest + 1) % max_frames;
+    --n_frames;
+}
+
+static bool
+oldest_overlaps(size_t start, size_t end)
+{
+    const HistoryEntry* e = FRAME(0);
+    return n_frames > 0 && e->offset < end && start < e->offset + e->size;
+}
+
+// Stores an encoded frame as the latest one, dropping as many old frames as needed to make room.
+static void
+store(const uint8_t* data, size_t sz, bool keyframe)
+{
+    if (sz > ring_sz) {
+        n_frames = 0;
+        return;
+    }
+    if (n_frames == max_frames)
+        drop_oldest();
+
+    size_t start = ring_tail;
+    if (start + sz > ring_sz) {
+        // wrap around: the frames between the tail and the end of the buffer are the oldest ones
+        while (oldest_overlaps(ring_tail, ring_sz))
+            drop_oldest();
+        start = 0;
+    }
+    while (oldest_overlaps(start, start + sz))
+        drop_oldest();
+
+    memcpy(&ring[start], data, sz);
+    *FRAME(n_frames) = (HistoryEntry) { (uint32_t) start, (uint32_t) sz, keyframe };
+    ++n_frames;
+    ring_tail = start + sz;
+}
+
+// }}}
+
+void
+history_start(int max, size_t budget, int keyframe_interval)
+{
+    history_stop();
+    ring = malloc(budget);
+    frames = calloc(max, sizeof(HistoryEntry));
+    latest = calloc(1, sizeof(Snapshot));
+    scratch = malloc(sizeof(Snapshot));
+    encoded = malloc(MAX_ENCODED_SZ);
+    if (!ring || !frames || !latest || !scratch || !encoded) {
+        history_stop();
+        return;
+    }
+    ring_sz = budget;
+    max_frames = max;
+    keyframe_every = keyframe_interval;
+    history_push();
+}
+
+void
+history_stop()
+{
+    free(ring);
+    free(frames);
+    free(latest);
+    free(scratch);
+    free(encoded);
+    memset(&current_machine->history, 0, sizeof current_machine->history);
+}
+
+bool
+history_enabled()
+{
+    return ring != NULL;
+}
+
+void
+history_push()
+{
+    if (!ring)
+        return;
+    emulator_snapshot(scratch);
+
+    // the first state pushed has nothing to be compared with (see history_start)
+    if (latest->size != 0) {
+        bool keyframe = (++since_keyframe >= keyframe_every);
+        if (keyframe)
+            since_keyframe = 0;
+        size_t sz = encode((const uint8_t*) latest, keyframe ? NULL : (const uint8_t*) scratch, sizeof(Snapshot), encoded);
+        store(encoded, sz, keyframe);
+    }
+
+    Snapshot* s = latest;
+    latest = scratch;
+    scratch = s;
+}
+
+int
+history_frames()
+{
+    return n_frames;
+}
+
+int
+history_back(int n)
+{
+    if (!ring || n <= 0)
+        return 0;
+    if (n > n_frames)
+        n = n_frames;
+    if (n == 0)
+        return 0;
+    int target = n_frames - n;
+
+    // start from the closest keyframe after the target, if any; otherwise, from the latest state
+    int from = n_frames;
+    for (int i = target; i < n_frames; ++i) {
+        if (FRAME(i)->keyframe) {
+            from = i;
+            break;
+        }
+    }
+    uint8_t* state = (uint8_t*) latest;
+    if (from < n_frames)
+        decode(&ring[FRAME(from)->offset], FRAME(from)->size, state, true);
+    for (int i = from - 1; i >= target; --i)
+        decode(&ring[FRAME(i)->offset], FRAME(i)->size, state, false);
+
+    n_frames = target;
+    if (n_frames > 0)
+        ring_tail = FRAME(n_frames - 1)->offset + FRAME(n_frames - 1)->size;
+    since_keyframe = 0;
+    emulator_restore(latest);
+    return n;
+}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
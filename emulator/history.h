@@ -0,0 +1,37 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewind history: the state of the machine at the end of each of the last frames, so the program
+// can be run backwards. The latest state is kept as a snapshot (see snapshot.h), and each older
+// frame as the XOR against the frame after it, run-length encoded (most of the memory doesn't
+// change from one frame to the next). Every few frames a full keyframe is stored instead, so going
+// back many frames at once doesn't need to go through all the deltas.
+//
+// Frames are stored in a ring buffer with a fixed size: when it's full, the oldest frames are
+// dropped.
+
+#define HISTORY_DEFAULT_FRAMES     3600         // 60 seconds
+#define HISTORY_DEFAULT_BUDGET     (8 << 20)    // bytes
+#define HISTORY_KEYFRAME_INTERVAL  60
+
+typedef struct HistoryEntry {
+    uint32_t offset;        // in the ring buffer
+    uint32_t size;
+    bool     keyframe;
+} HistoryEntry;
+
+void history_start(int max_frames, size_t budget, int keyframe_interval);
+void history_stop();
+bool history_enabled();
+
+void history_push();                // saves the current state (called at the end of each frame)
+int  history_frames();              // how many frames it can go back
+int  history_back(int frames);      // returns how many frames it went back
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
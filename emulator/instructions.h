@@ -0,0 +1,184 @@
+// Instruction set implementation. This file has no include guard on purpose: it is included by
+// cpu.c once for each dispatch engine, with the following macros defined:
+//
+//   INSTRUCTION(opcode, name)  start of the instruction implementation
+//   NEXT                       end of the instruction, carry on with the next one
+//   LEAVE                      end of the instruction, when it might have raised an event that the
+//                              CPU needs to look at before executing the next one (an interrupt was
+//                              queued, the CPU is waiting, etc)
+//   SKIP_NEXT_IF(cond)         end of a conditional instruction: skip the next one if `cond` is true
+//   JUMP(addr)                 end of a jump: carry on at `addr` (the engine might need to check if
+//                              the CPU is idle, in a jump to itself)
+//   DEBUGGER()                 end of the instruction, request the debugger
+//
+// Parameters are available in `par1` (destination) and `par2` (origin).
+
+INSTRUCTION(0x0, "NOP")
+    NEXT;
+INSTRUCTION(0x1, "DBG")
+    DEBUGGER();
+INSTRUCTION(0x2, "MOV")
+    set_par(par1, par2->value);
+    NEXT;
+
+INSTRUCTION(0x10, "OR")
+    set_par(par1, par1->value | par2->value);
+    NEXT;
+INSTRUCTION(0x11, "AND")
+    set_par(par1, par1->value & par2->value);
+    NEXT;
+INSTRUCTION(0x12, "XOR")
+    set_par(par1, par1->value ^ par2->value);
+    NEXT;
+INSTRUCTION(0x13, "SHL")
+    set_par_with_overflow(par1, ((uint32_t) par1->value) << par2->value);
+    NEXT;
+INSTRUCTION(0x14, "SHR")
+    set_par(par1, par1->value >> par2->value);
+    NEXT;
+INSTRUCTION(0x15, "NOT")
+    set_par(par1, ~par1->value);
+    NEXT;
+
+INSTRUCTION(0x20, "ADD")
+    set_par_with_overflow(par1, par1->value + par2->value);
+    NEXT;
+INSTRUCTION(0x22, "SUB")
+    set_par_with_overflow(par1, par1->value - par2->value);
+    NEXT;
+INSTRUCTION(0x24, "MUL")
+    set_par_with_overflow(par1, par1->value * par2->value);
+    NEXT;
+INSTRUCTION(0x26, "DIV")
+    if (par2->value == 0)
+        cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
+    else
+        set_par(par1, par1->value / par2->value);
+    LEAVE;
+INSTRUCTION(0x27, "DIV$")
+    if (par2->value == 0)
+        cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
+    else
+        set_par(par1, par1->value / (int16_t)par2->value);
+    LEAVE;
+INSTRUCTION(0x29, "MOD")
+    if (par2->value == 0)
+        cpu_interrupt(INT_CPU, XT_CPU_DIVZERO);
+    else
+        set_par(par1, par1->value % par2->value);
+    LEAVE;
+INSTRUCTION(0x2a, "INC")
+    set_par_with_overflow(par1, par1->value + 1);
+    NEXT;
+INSTRUCTION(0x2b, "DEC")
+    set_par_with_overflow(par1, par1->value - 1);
+    NEXT;
+
+INSTRUCTION(0x30, "IFNE")
+    SKIP_NEXT_IF(par1->value == par2->value);
+INSTRUCTION(0x31, "IFEQ")
+    SKIP_NEXT_IF(par1->value != par2->value);
+INSTRUCTION(0x32, "IFGT")
+    SKIP_NEXT_IF(par1->value <= par2->value);
+INSTRUCTION(0x33, "IFGT$")
+    SKIP_NEXT_IF((int16_t) par1->value <= (int16_t) par2->value);
+INSTRUCTION(0x35, "IFLT")
+    SKIP_NEXT_IF(par1->value >= par2->value);
+INSTRUCTION(0x36, "IFLT$")
+    SKIP_NEXT_IF((int16_t) par1->value >= (int16_t) par2->value);
+INSTRUCTION(0x38, "IFGE")
+    SKIP_NEXT_IF(par1->value < par2->value);
+INSTRUCTION(0x39, "IFGE$")
+    SKIP_NEXT_IF((int16_t) par1->value < (int16_t) par2->value);
+INSTRUCTION(0x3C, "IFLE")
+    SKIP_NEXT_IF(par1->value > par2->value);
+INSTRUCTION(0x3D, "IFLE$")
+    SKIP_NEXT_IF((int16_t) par1->value > (int16_t) par2->value);
+
+#define PUSH16(n) { ram_set_bypass(SP--, ((n) >> 8) & 0xff); ram_set_bypass(SP--, (n) & 0xff); }
+#define POP16() (SP += 2, ram[(reg_t) (SP-1)] | (ram[SP] << 8))
+INSTRUCTION(0x50, "PUSHB")
+    ram_set_bypass(SP--, par1->value);
+    NEXT;
+INSTRUCTION(0x51, "PUSHW")
+    PUSH16(par1->value)
+    NEXT;
+INSTRUCTION(0x52, "POPB")
+    set_par(par1, ram[++SP]);
+    NEXT;
+INSTRUCTION(0x53, "POP16")
+    set_par(par1, POP16());
+    NEXT;
+INSTRUCTION(0x54, "PUSHA")
+    PUSH16(A)
+    PUSH16(B)
+    PUSH16(C)
+    PUSH16(D)
+    PUSH16(E)
+    PUSH16(F)
+    PUSH16(I)
+    PUSH16(J)
+    PUSH16(K)
+    PUSH16(X)
+    PUSH16(Y)
+    PUSH16(FP)
+    PUSH16(OV)
+    NEXT;
+INSTRUCTION(0x55, "POPA")
+    OV = POP16();
+    FP = POP16();
+    Y = POP16();
+    X = POP16();
+    K = POP16();
+    J = POP16();
+    I = POP16();
+    F = POP16();
+    E = POP16();
+    D = POP16();
+    C = POP16();
+    B = POP16();
+    A = POP16();
+    NEXT;
+INSTRUCTION(0x56, "POPN")
+    SP += par1->value;
+    NEXT;
+#undef PUSH16
+#undef POP16
+
+INSTRUCTION(0x60, "JMP")
+    JUMP(par1->value);
+INSTRUCTION(0x61, "JSR")
+    ram_set_bypass(SP--, PC >> 8);  // push next instruction PC onto stack
+    ram_set_bypass(SP--, PC & 0xff);
+    PC = par1->value;
+    NEXT;
+INSTRUCTION(0x62, "RET")
+    PC = ram[++SP];
+    PC |= ram[++SP] << 8;
+    NEXT;
+
+INSTRUCTION(0x70, "DEV")
+    if (hw_fptr[par1->value & 0xff])
+        hw_fptr[par1->value & 0xff](par2->value & 0xffff);
+    LEAVE;
+INSTRUCTION(0x71, "IVEC")
+    ints.vector[par1->value & 0xff] = par2->value;
+    NEXT;
+INSTRUCTION(0x72, "INT")
+    cpu_interrupt(par1->value & 0xff, par2->value);
+    LEAVE;
+INSTRUCTION(0x73, "IRET")
+    if (ints.happening)
+        leave_interrupt();
+    else
+        cpu_interrupt(INT_CPU, XT_CPU_IRET);
+    LEAVE;
+INSTRUCTION(0x74, "WAIT")
+    ints.waiting = true;
+    LEAVE;
+INSTRUCTION(0x75, "IENAB")
+    ints.active = par1->value & 1;
+    update_pending();
+    LEAVE;
+
+// vim:st=4:sts=4:sw=4:expandtab
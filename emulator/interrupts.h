@@ -9,10 +9,15 @@ typedef struct QueuedInterrupt {
     uint16_t xt_value;
 } QueuedInterrupt;
 
+#define INTERRUPT_QUEUE_SZ  256     // must be a power of 2
+
 typedef struct Interrupts {
     uint8_t         vector[256];
-    QueuedInterrupt queue[256];
-    uint8_t         queue_idx;
+    QueuedInterrupt queue[INTERRUPT_QUEUE_SZ];  // ring buffer
+    uint16_t        queue_head;                 // index of the next interrupt to be dequeued
+    uint16_t        queue_len;
+    uint32_t        overflows;                  // interrupts dropped because the queue was full
+    bool            pending;                    // an interrupt can be entered now (see update_pending)
     bool            active;
     bool            happening;
     bool            waiting;
@@ -0,0 +1,579 @@
+#include "jit.h"
+
+#if JIT
+
+#if !defined(__x86_64__) || !defined(__unix__)
+#  error "The JIT is only supported on x86-64 unix systems."
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "decode.h"
+#include "machinestate.h"
+#include "memory.h"
+#include "mmap.h"
+
+// The JIT translates basic blocks of retrolab code into x86-64 code. A block is a sequence of
+// register/memory ALU instructions (MOV, OR, AND, XOR, SHL, SHR, NOT, ADD, SUB, MUL, INC, DEC, NOP)
+// that can be closed by a JMP or a IFxx. Everything else (stack, interrupts, devices, DIV/MOD,
+// instructions using PC as an operand...) ends the block, and is executed by the interpreter.
+//
+// Inside a block, the guest registers it uses live in callee-saved host registers, and are
+// written back to `reg[]` on every exit. Memory writes go through ram_set/ram_set16, so they are
+// tracked as usual; when a write hits translated code, the affected blocks are thrown away and
+// the running block exits right after the write.
+//
+// CPU_RANDOM is generated by the interpreter when it is read, so blocks exit before any
+// instruction that reads or writes it.
+
+// {{{ blocks
+
+#define CODE_BUFFER_SZ          (4 * 1024 * 1024)
+#define MAX_BLOCKS              16384
+#define MAX_BLOCK_INSTRUCTIONS  32
+#define MAX_BLOCK_CODE_SZ       (16 * 1024)
+#define MAX_BLOCK_SPAN          (0x100 + 2 * MAX_INSTRUCTION_SZ)  // instructions + skipped instruction
+#define MAX_HOST_REGS           5
+
+#define REG_PC  0xe
+#define REG_OV  0xf
+
+typedef int (*BlockFunction)(reg_t* reg);
+
+typedef struct JitBlock {
+    BlockFunction code;     // NULL if no instruction could be translated
+    reg_t         start;
+    reg_t         len;      // number of bytes of guest code the block depends on
+    uint8_t       n;        // number of instructions
+} JitBlock;
+
+// JIT state of each machine, allocated the first time the machine runs translated code
+typedef struct JitState {
+    uint8_t*  code_buffer;
+    size_t    code_used;
+    JitBlock  blocks[MAX_BLOCKS];
+    size_t    n_blocks;
+    JitBlock* block_at[0x10000];
+    bool      unavailable;
+} JitState;
+
+#define jit          (current_machine->jit)
+#define code_buffer  (jit->code_buffer)
+#define code_used    (jit->code_used)
+#define blocks       (jit->blocks)
+#define n_blocks     (jit->n_blocks)
+#define block_at     (jit->block_at)
+
+static _Thread_local bool code_invalidated = false;
+
+// }}}
+
+// {{{ x86-64 encoding
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39 };
+enum { EXT_ADD = 0, EXT_SUB = 5, EXT_CMP = 7, EXT_SHL = 4, EXT_SHR = 5, EXT_NOT = 2 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+       CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf };
+
+static const uint8_t host_regs[MAX_HOST_REGS] = { RBX, RBP, R12, R13, R14 };  // R15 points to reg[]
+
+static _Thread_local uint8_t* p;
+
+static void emit8(uint8_t v)   { *p++ = v; }
+static void emit16(uint16_t v) { memcpy(p, &v, 2); p += 2; }
+static void emit32(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+static void emit64(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+
+static void
+rex(bool w, uint8_t r, uint8_t x, uint8_t b)
+{
+    uint8_t v = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+    if (v != 0x40)
+        emit8(v);
+}
+
+static void modrm_rr(uint8_t reg, uint8_t rm) { emit8(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+static void mov_rr(uint8_t dst, uint8_t src)      { rex(0, src, 0, dst); emit8(0x89); modrm_rr(src, dst); }
+static void mov64_rr(uint8_t dst, uint8_t src)    { rex(1, src, 0, dst); emit8(0x89); modrm_rr(src, dst); }
+static void mov_ri(uint8_t dst, uint32_t imm)     { rex(0, 0, 0, dst); emit8(0xb8 + (dst & 7)); emit32(imm); }
+static void movabs(uint8_t dst, uint64_t imm)     { rex(1, 0, 0, dst); emit8(0xb8 + (dst & 7)); emit64(imm); }
+static void movzx16(uint8_t dst, uint8_t src)     { rex(0, dst, 0, src); emit8(0x0f); emit8(0xb7); modrm_rr(dst, src); }
+static void movsx16(uint8_t dst, uint8_t src)     { rex(0, dst, 0, src); emit8(0x0f); emit8(0xbf); modrm_rr(dst, src); }
+static void alu_rr(uint8_t op, uint8_t dst, uint8_t src) { rex(0, src, 0, dst); emit8(op); modrm_rr(src, dst); }
+static void alu_ri(uint8_t ext, uint8_t dst, uint32_t imm) { rex(0, 0, 0, dst); emit8(0x81); modrm_rr(ext, dst); emit32(imm); }
+static void test_rr(uint8_t dst, uint8_t src)     { rex(0, src, 0, dst); emit8(0x85); modrm_rr(src, dst); }
+static void imul_rr(uint8_t dst, uint8_t src)     { rex(0, dst, 0, src); emit8(0x0f); emit8(0xaf); modrm_rr(dst, src); }
+static void shift_cl(uint8_t ext, uint8_t dst)    { rex(0, 0, 0, dst); emit8(0xd3); modrm_rr(ext, dst); }
+static void shift_ri(uint8_t ext, uint8_t dst, uint8_t n) { rex(0, 0, 0, dst); emit8(0xc1); modrm_rr(ext, dst); emit8(n); }
+static void not_r(uint8_t dst)                    { rex(0, 0, 0, dst); emit8(0xf7); modrm_rr(EXT_NOT, dst); }
+static void push(uint8_t r)                       { rex(0, 0, 0, r); emit8(0x50 + (r & 7)); }
+static void pop(uint8_t r)                        { rex(0, 0, 0, r); emit8(0x58 + (r & 7)); }
+
+// movzx dst, word [r15 + 2*g]
+static void
+load_guest(uint8_t dst, uint8_t g)
+{
+    rex(0, dst, 0, R15); emit8(0x0f); emit8(0xb7); emit8(0x40 | ((dst & 7) << 3) | (R15 & 7)); emit8(2 * g);
+}
+
+// mov word [r15 + 2*g], src
+static void
+store_guest(uint8_t g, uint8_t src)
+{
+    emit8(0x66); rex(0, src, 0, R15); emit8(0x89); emit8(0x40 | ((src & 7) << 3) | (R15 & 7)); emit8(2 * g);
+}
+
+// mov word [r15 + 2*g], imm
+static void
+store_guest_imm(uint8_t g, uint16_t imm)
+{
+    emit8(0x66); rex(0, 0, 0, R15); emit8(0xc7); emit8(0x40 | (R15 & 7)); emit8(2 * g); emit16(imm);
+}
+
+// movzx dst, byte [rsi + index]
+static void
+load_ram8(uint8_t dst, uint8_t index)
+{
+    rex(0, dst, index, RSI); emit8(0x0f); emit8(0xb6); emit8(0x04 | ((dst & 7) << 3)); emit8(((index & 7) << 3) | RSI);
+}
+
+static void
+call_abs(const void* fn)
+{
+    movabs(RAX, (uintptr_t) fn);
+    emit8(0xff); emit8(0xd0);   // call rax
+}
+
+static uint8_t*
+jcc(uint8_t cc)
+{
+    emit8(0x0f); emit8(0x80 | cc);
+    uint8_t* rel = p;
+    emit32(0);
+    return rel;
+}
+
+static void
+patch(uint8_t* rel)
+{
+    int32_t v = (int32_t) (p - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+
+// }}}
+
+// {{{ memory writes
+
+static int
+store8(uint32_t addr, uint32_t value)
+{
+    code_invalidated = false;
+    ram_set(addr, value);
+    return code_invalidated;
+}
+
+static int
+store16(uint32_t addr, uint32_t value)
+{
+    code_invalidated = false;
+    ram_set16(addr, value);
+    return code_invalidated;
+}
+
+// }}}
+
+// {{{ translation
+
+typedef struct Translation {
+    const DecodedInstruction* in[MAX_BLOCK_INSTRUCTIONS];
+    uint8_t n;
+    bool    terminated;       // last instruction is a jump or a skip
+    reg_t   end;              // address after the last instruction (or after the one it can skip)
+    reg_t   skip_pc;
+    int8_t  host[16];         // host register for each guest register, or -1
+    uint8_t n_regs;
+} Translation;
+
+static int
+n_parameters(uint8_t op)
+{
+    switch (op) {
+        case 0x0:
+            return 0;
+        case 0x15: case 0x2a: case 0x2b: case 0x60: case 0x63:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+static bool
+is_alu(uint8_t op)
+{
+    switch (op) {
+        case 0x0: case 0x2:
+        case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15:
+        case 0x20: case 0x22: case 0x24: case 0x2a: case 0x2b:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+is_skip(uint8_t op)
+{
+    switch (op) {
+        case 0x30: case 0x31: case 0x32: case 0x33: case 0x35:
+        case 0x36: case 0x38: case 0x39: case 0x3C: case 0x3D:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+sets_overflow(uint8_t op)
+{
+    return op == 0x13 || op == 0x20 || op == 0x22 || op == 0x24 || op == 0x2a || op == 0x2b;
+}
+
+static bool
+near_random(uint16_t addr)
+{
+    return (reg_t) (addr - (CPU_RANDOM - 1)) <= 2;
+}
+
+// Checks if an instruction can be added to the block, allocating host registers for it.
+static bool
+fits(Translation* t, const DecodedInstruction* in)
+{
+    if (!is_alu(in->op) && !is_skip(in->op) && in->op != 0x60 && in->op != 0x63)
+        return false;
+
+    uint8_t regs[3], n_regs = 0;
+    if (in->op != 0x63) {
+        for (int i = 0; i < n_parameters(in->op); ++i) {
+            const Operand* o = &in->par[i];
+            if (o->r == REG_PC)
+                return false;
+            if ((o->type == INDIRECT || o->type == INDIRECT_WORD) && o->r == NO_REGISTER && near_random(o->value))
+                return false;
+            if (o->r != NO_REGISTER)
+                regs[n_regs++] = o->r;
+        }
+    }
+    if (sets_overflow(in->op))
+        regs[n_regs++] = REG_OV;
+
+    int8_t host[16];
+    memcpy(host, t->host, sizeof host);
+    uint8_t used = t->n_regs;
+    for (int i = 0; i < n_regs; ++i) {
+        if (host[regs[i]] == -1) {
+            if (used == MAX_HOST_REGS)
+                return false;
+            host[regs[i]] = host_regs[used++];
+        }
+    }
+    memcpy(t->host, host, sizeof host);
+    t->n_regs = used;
+    return true;
+}
+
+static void
+emit_epilogue(const Translation* t, int count)
+{
+    for (uint8_t g = 0; g < 16; ++g)
+        if (t->host[g] != -1)
+            store_guest(g, t->host[g]);
+    mov_ri(RAX, count);
+    emit8(0x48); emit8(0x83); emit8(0xc4); emit8(0x08);   // add rsp, 8
+    pop(R15); pop(R14); pop(R13); pop(R12); pop(RBP); pop(RBX);
+    emit8(0xc3);   // ret
+}
+
+// Leaves the block, continuing at `pc` after `count` instructions were executed.
+static void
+emit_exit(const Translation* t, reg_t pc, int count)
+{
+    store_guest_imm(REG_PC, pc);
+    emit_epilogue(t, count);
+}
+
+static void
+emit_exit_if(const Translation* t, uint8_t cc, reg_t pc, int count)
+{
+    uint8_t* rel = jcc(cc ^ 1);
+    emit_exit(t, pc, count);
+    patch(rel);
+}
+
+// Loads the operand value in `dst`. Indirect operands also leave the address in `addr`.
+static void
+emit_operand(const Translation* t, const Operand* o, uint8_t dst, uint8_t addr, reg_t pc, int k)
+{
+    switch (o->type) {
+        case DIRECT:
+            mov_ri(dst, o->value);
+            break;
+        case REGISTER:
+            mov_rr(dst, t->host[o->r]);
+            break;
+        case INDIRECT:
+        case INDIRECT_WORD:
+            if (o->r == NO_REGISTER) {
+                mov_ri(addr, o->value);
+            } else {
+                mov_rr(addr, t->host[o->r]);
+                if (o->value)
+                    alu_ri(EXT_ADD, addr, o->value);
+                movzx16(addr, addr);
+                // leave the block if the address is close to CPU_RANDOM, and let the interpreter do it
+                mov_rr(RDX, addr);
+                alu_ri(EXT_SUB, RDX, CPU_RANDOM - 1);
+                movzx16(RDX, RDX);
+                alu_ri(EXT_CMP, RDX, 2);
+                emit_exit_if(t, CC_BE, pc, k);
+            }
+            movabs(RSI, (uintptr_t) ram);
+            load_ram8(dst, addr);
+            if (o->type == INDIRECT_WORD) {
+                mov_rr(RDX, addr);
+                alu_ri(EXT_ADD, RDX, 1);
+                movzx16(RDX, RDX);
+                load_ram8(RDX, RDX);
+                shift_ri(EXT_SHL, RDX, 8);
+                alu_rr(ALU_OR, dst, RDX);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+emit_result(const Translation* t, const DecodedInstruction* in, int k)
+{
+    const Operand* dest = &in->par[0];
+    bool overflow = sets_overflow(in->op);
+
+    if (dest->type == REGISTER)
+        movzx16(t->host[dest->r], RAX);
+    if (overflow) {
+        mov_rr(t->host[REG_OV], RAX);
+        shift_ri(EXT_SHR, t->host[REG_OV], 16);
+    }
+    if (dest->type == INDIRECT || dest->type == INDIRECT_WORD) {
+        mov_rr(RSI, RAX);    // the address is already in RDI
+        call_abs(dest->type == INDIRECT ? (const void*) store8 : (const void*) store16);
+        test_rr(RAX, RAX);
+        emit_exit_if(t, CC_NE, in->next_pc, k + 1);
+    }
+}
+
+static void
+emit_skip(const Translation* t, const DecodedInstruction* in, int k)
+{
+    uint8_t cc;
+    bool is_signed = false;
+    switch (in->op) {
+        case 0x30: cc = CC_E;  break;                       // IFNE
+        case 0x31: cc = CC_NE; break;                       // IFEQ
+        case 0x32: cc = CC_BE; break;                       // IFGT
+        case 0x33: cc = CC_LE; is_signed = true; break;     // IFGT$
+        case 0x35: cc = CC_AE; break;                       // IFLT
+        case 0x36: cc = CC_GE; is_signed = true; break;     // IFLT$
+        case 0x38: cc = CC_B;  break;                       // IFGE
+        case 0x39: cc = CC_L;  is_signed = true; break;     // IFGE$
+        case 0x3C: cc = CC_A;  break;                       // IFLE
+        default:   cc = CC_G;  is_signed = true; break;     // IFLE$
+    }
+    if (is_signed) {
+        movsx16(RAX, RAX);
+        movsx16(RCX, RCX);
+    }
+    alu_rr(ALU_CMP, RAX, RCX);
+    emit_exit_if(t, cc, t->skip_pc, k + 1);   // skipping is part of the same step (see cpu.c)
+    emit_exit(t, in->next_pc, k + 1);
+}
+
+static void
+emit_instruction(const Translation* t, const DecodedInstruction* in, int k)
+{
+    if (in->op == 0x63) {
+        emit_exit(t, in->par[0].value, k + 1);
+        return;
+    }
+
+    if (n_parameters(in->op) >= 1)
+        emit_operand(t, &in->par[0], RAX, RDI, in->pc, k);
+    if (n_parameters(in->op) >= 2)
+        emit_operand(t, &in->par[1], RCX, R8, in->pc, k);
+
+    switch (in->op) {
+        case 0x0:  return;                              // NOP
+        case 0x2:  mov_rr(RAX, RCX); break;             // MOV
+        case 0x10: alu_rr(ALU_OR, RAX, RCX); break;     // OR
+        case 0x11: alu_rr(ALU_AND, RAX, RCX); break;    // AND
+        case 0x12: alu_rr(ALU_XOR, RAX, RCX); break;    // XOR
+        case 0x13: shift_cl(EXT_SHL, RAX); break;       // SHL
+        case 0x14: shift_cl(EXT_SHR, RAX); break;       // SHR
+        case 0x15: not_r(RAX); break;                   // NOT
+        case 0x20: alu_rr(ALU_ADD, RAX, RCX); break;    // ADD
+        case 0x22: alu_rr(ALU_SUB, RAX, RCX); break;    // SUB
+        case 0x24: imul_rr(RAX, RCX); break;            // MUL
+        case 0x2a: alu_ri(EXT_ADD, RAX, 1); break;      // INC
+        case 0x2b: alu_ri(EXT_SUB, RAX, 1); break;      // DEC
+        case 0x60:                                      // JMP
+            store_guest(REG_PC, RAX);
+            emit_epilogue(t, k + 1);
+            return;
+        default:
+            emit_skip(t, in, k);
+            return;
+    }
+    emit_result(t, in, k);
+}
+
+static JitBlock*
+translate(reg_t start)
+{
+    if (n_blocks == MAX_BLOCKS || code_used + MAX_BLOCK_CODE_SZ > CODE_BUFFER_SZ)
+        jit_flush();
+
+    Translation t = { .n = 0, .terminated = false, .n_regs = 0 };
+    memset(t.host, -1, sizeof t.host);
+
+    // find out which instructions go in the block
+    reg_t pc = start;
+    while (t.n < MAX_BLOCK_INSTRUCTIONS && (pc >> 8) == (start >> 8)) {
+        const DecodedInstruction* in = cpu_decode_instruction(pc);
+        if (!fits(&t, in))
+            break;
+        t.in[t.n++] = in;
+        t.end = pc = in->next_pc;
+        if (is_skip(in->op))
+            t.end = t.skip_pc = in->pair_end;
+        if (is_skip(in->op) || in->op == 0x60 || in->op == 0x63) {
+            t.terminated = true;
+            break;
+        }
+    }
+
+    JitBlock* block = &blocks[n_blocks++];
+    block->start = start;
+    block->n = t.n;
+    if (t.n == 0) {
+        // nothing to translate: remember it, so it isn't tried again until the code changes
+        block->code = NULL;
+        block->len = (reg_t) (cpu_decode_instruction(start)->next_pc - start);
+        return block;
+    }
+    block->len = (reg_t) (t.end - start);
+
+    // generate code
+    p = &code_buffer[code_used];
+    block->code = (BlockFunction) p;
+    push(RBX); push(RBP); push(R12); push(R13); push(R14); push(R15);
+    emit8(0x48); emit8(0x83); emit8(0xec); emit8(0x08);   // sub rsp, 8 (align the stack for calls)
+    mov64_rr(R15, RDI);
+    for (uint8_t g = 0; g < 16; ++g)
+        if (t.host[g] != -1)
+            load_guest(t.host[g], g);
+
+    for (int k = 0; k < t.n; ++k)
+        emit_instruction(&t, t.in[k], k);
+    if (!t.terminated)
+        emit_exit(&t, pc, t.n);
+
+    code_used = (size_t) (p - code_buffer);
+    return block;
+}
+
+// }}}
+
+// {{{ execution
+
+int
+jit_run(reg_t* reg, int max_steps)
+{
+    if (!jit) {
+        jit = calloc(1, sizeof(JitState));
+        if (!jit)
+            return 0;
+    }
+    if (!code_buffer) {
+        if (jit->unavailable)
+            return 0;
+        void* buf = mmap(NULL, CODE_BUFFER_SZ, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+#if !TESTING
+            perror("JIT disabled: could not allocate executable memory");
+#endif
+            jit->unavailable = true;
+            return 0;
+        }
+        code_buffer = buf;
+    }
+
+    reg_t pc = reg[REG_PC];
+    JitBlock* block = block_at[pc];
+    if (!block)
+        block = block_at[pc] = translate(pc);
+    if (!block->code || block->n > max_steps)
+        return 0;
+
+    int executed = block->code(reg);
+    assert(executed >= 0 && executed <= block->n);
+    return executed;
+}
+
+void
+jit_invalidate(uint16_t addr)
+{
+    if (!jit)
+        return;
+    for (reg_t i = 0; i < MAX_BLOCK_SPAN; ++i) {
+        reg_t start = addr - i;
+        JitBlock* block = block_at[start];
+        if (block && (reg_t) (addr - start) < block->len) {
+            block_at[start] = NULL;
+            code_invalidated = true;
+        }
+    }
+}
+
+void
+jit_flush()
+{
+    if (!jit)
+        return;
+    memset(block_at, 0, sizeof block_at);
+    n_blocks = 0;
+    code_used = 0;
+}
+
+void
+jit_destroy()
+{
+    if (!jit)
+        return;
+    if (code_buffer)
+        munmap(code_buffer, CODE_BUFFER_SZ);
+    free(jit);
+    jit = NULL;
+}
+
+// }}}
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -0,0 +1,15 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+int  jit_run(reg_t* reg, int max_steps);
+void jit_invalidate(uint16_t addr);
+void jit_flush();
+void jit_destroy();
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
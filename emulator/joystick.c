@@ -6,6 +6,7 @@
 #include "cpu.h"
 #include "memory.h"
 #include "mmap.h"
+#include "replay.h"
 
 void
 joystic_update_state()
@@ -28,7 +29,7 @@ joystic_update_state()
         r |= (1 << 6);
     if (s[SDL_SCANCODE_S])
         r |= (1 << 7);
-    ram[JOYSTICK_STATE] = r;
+    replay_input_ram(JOYSTICK_STATE, r);
 }
 
 void
@@ -46,7 +47,7 @@ joystick_interrupt(SDL_Event* e)
             case SDLK_s: {
                     joystic_update_state();
                     uint8_t state = ram[JOYSTICK_STATE];
-                    cpu_interrupt(INT_JOYSTICK, state);
+                    replay_input_interrupt(INT_JOYSTICK, state);
                 }
                 break;
         }
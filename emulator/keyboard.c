@@ -2,6 +2,7 @@
 
 #include "cpu.h"
 #include "mmap.h"
+#include "replay.h"
 
 static uint16_t
 add_mod(uint16_t key)
@@ -42,13 +43,13 @@ keyboard_interrupt(SDL_Event* e)
                 if (key == 0)
                     return;
                 add_mod(key);
-                cpu_interrupt(INT_KEYBOARD, key);
+                replay_input_interrupt(INT_KEYBOARD, key);
             }
             break;
         case SDL_TEXTINPUT: {  // regular keys
                 uint16_t key = e->text.text[0];
                 add_mod(key);
-                cpu_interrupt(INT_KEYBOARD, key);
+                replay_input_interrupt(INT_KEYBOARD, key);
             }
             break;
     }
@@ -0,0 +1,219 @@
+#include "machine.h"
+
+#include <stdlib.h>
+
+#include "breakpoints.h"
+#include "cpu.h"
+#include "emulator.h"
+#include "framebuffer.h"
+#include "history.h"
+#include "machinestate.h"
+#include "memory.h"
+#include "recorder.h"
+#include "replay.h"
+#include "timer.h"
+#include "trace.h"
+
+static RetrolabMachine default_machine = {
+    .cpu.ints             = { .vector = { NO_INTERRUPT }, .active = true },
+    .memory.last_updated  = { -1, -1 },
+    .scheduler            = { .heap = { { STEPS_PER_FRAME, SCHED_END_OF_FRAME }, { STEPS_PER_FRAME, SCHED_TIMERS } },
+                              .n_events = 2 },
+    .breakpoints.tmp_brk  = -1,
+};
+
+_Thread_local RetrolabMachine* current_machine = &default_machine;
+
+#define ON_MACHINE(m, ...) {                            \
+        RetrolabMachine* previous = machine_select(m);  \
+        __VA_ARGS__;                                    \
+        machine_select(previous);                       \
+    }
+
+// {{{ machine lifecycle
+
+RetrolabMachine*
+machine_new()
+{
+    RetrolabMachine* m = calloc(1, sizeof(RetrolabMachine));
+    if (!m)
+        return NULL;
+    m->breakpoints.tmp_brk = -1;
+    m->emulator.headless = true;
+
+    // same as emulator_init(true), headless
+    ON_MACHINE(m,
+        emulator_set_frame_position(0);
+        ram_init();
+        ram[0x0] = 0x60;
+        cpu_init();
+        timer_init();
+        framebuffer_reset()
+    )
+    return m;
+}
+
+void
+machine_free(RetrolabMachine* m)
+{
+    if (!m || m == &default_machine)
+        return;
+    ON_MACHINE(m,
+        cpu_destroy();
+        framebuffer_free();
+        bkps_clear();
+        trace_stop();
+        history_stop();
+        replay_stop();
+        recorder_stop()
+    )
+    if (current_machine == m)
+        current_machine = &default_machine;
+    free(m);
+}
+
+// }}}
+
+// {{{ selection
+
+RetrolabMachine*
+machine_default()
+{
+    return &default_machine;
+}
+
+RetrolabMachine*
+machine_current()
+{
+    return current_machine;
+}
+
+RetrolabMachine*
+machine_select(RetrolabMachine* m)
+{
+    RetrolabMachine* previous = current_machine;
+    current_machine = m ? m : &default_machine;
+    return previous;
+}
+
+// }}}
+
+// {{{ execution
+
+CpuError
+machine_step(RetrolabMachine* m)
+{
+    CpuError e;
+    ON_MACHINE(m, e = emulator_step())
+    return e;
+}
+
+CpuError
+machine_frame(RetrolabMachine* m)
+{
+    CpuError e;
+    ON_MACHINE(m, e = emulator_frame())
+    return e;
+}
+
+void
+machine_hard_reset(RetrolabMachine* m)
+{
+    ON_MACHINE(m, emulator_hard_reset())
+}
+
+void
+machine_soft_reset(RetrolabMachine* m)
+{
+    ON_MACHINE(m, emulator_soft_reset())
+}
+
+void
+machine_snapshot(RetrolabMachine* m, Snapshot* s)
+{
+    ON_MACHINE(m, emulator_snapshot(s))
+}
+
+int
+machine_restore(RetrolabMachine* m, const Snapshot* s)
+{
+    int r;
+    ON_MACHINE(m, r = emulator_restore(s))
+    return r;
+}
+
+// }}}
+
+// {{{ memory
+
+void
+machine_load_rom(RetrolabMachine* m, const char* filename)
+{
+    ON_MACHINE(m, emulator_load_rom(filename))
+}
+
+int
+machine_load(RetrolabMachine* m, uint16_t start, const uint8_t* data, size_t sz)
+{
+    int r;
+    ON_MACHINE(m, r = ram_load(start, data, sz))
+    return r;
+}
+
+uint8_t*
+machine_ram(RetrolabMachine* m)
+{
+    uint8_t* r;
+    ON_MACHINE(m, r = ram)
+    return r;
+}
+
+// }}}
+
+// {{{ cpu
+
+reg_t
+machine_register(RetrolabMachine* m, uint8_t idx)
+{
+    return idx < 16 ? m->cpu.reg[idx] : 0;
+}
+
+CpuError
+machine_error(RetrolabMachine* m)
+{
+    return m->cpu.error;
+}
+
+void
+machine_interrupt(RetrolabMachine* m, uint8_t number, uint16_t xt_value)
+{
+    ON_MACHINE(m, cpu_interrupt(number, xt_value))
+}
+
+void
+machine_set_hardware_fpointer(RetrolabMachine* m, uint8_t hw, void(*fptr)(uint16_t data))
+{
+    ON_MACHINE(m, cpu_set_hardware_fpointer(hw, fptr))
+}
+
+void
+machine_set_random_seed(RetrolabMachine* m, uint64_t seed)
+{
+    ON_MACHINE(m, cpu_set_random_seed(seed))
+}
+
+// }}}
+
+// {{{ debugging
+
+int
+machine_dbg_json(RetrolabMachine* m, size_t memory_block, char* buf, size_t bufsz)
+{
+    int n;
+    ON_MACHINE(m, n = emulator_dbg_json(memory_block, buf, bufsz))
+    return n;
+}
+
+// }}}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
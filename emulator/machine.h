@@ -0,0 +1,47 @@
+#ifndef MACHINE_H_
+#define MACHINE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// A complete retrolab machine: memory, CPU registers, interrupts, timers and breakpoints.
+//
+// The emulator_*, cpu_*, ram_*, timer_* and bkps_* functions operate on the machine selected in
+// the calling thread, which is the default machine unless machine_select is called. The machine_*
+// functions below take the machine explicitly, so each thread can run its own machines. A machine
+// must not be used by two threads at the same time.
+
+typedef struct RetrolabMachine RetrolabMachine;
+
+RetrolabMachine* machine_new();
+void             machine_free(RetrolabMachine* m);
+
+RetrolabMachine* machine_default();
+RetrolabMachine* machine_current();
+RetrolabMachine* machine_select(RetrolabMachine* m);    // returns the previously selected machine
+
+CpuError         machine_step(RetrolabMachine* m);
+CpuError         machine_frame(RetrolabMachine* m);
+void             machine_hard_reset(RetrolabMachine* m);
+void             machine_soft_reset(RetrolabMachine* m);
+void             machine_snapshot(RetrolabMachine* m, Snapshot* s);
+int              machine_restore(RetrolabMachine* m, const Snapshot* s);
+
+void             machine_load_rom(RetrolabMachine* m, const char* filename);
+int              machine_load(RetrolabMachine* m, uint16_t start, const uint8_t* data, size_t sz);
+uint8_t*         machine_ram(RetrolabMachine* m);
+
+reg_t            machine_register(RetrolabMachine* m, uint8_t idx);
+CpuError         machine_error(RetrolabMachine* m);
+void             machine_interrupt(RetrolabMachine* m, uint8_t number, uint16_t xt_value);
+void             machine_set_hardware_fpointer(RetrolabMachine* m, uint8_t hw, void(*fptr)(uint16_t data));
+void             machine_set_random_seed(RetrolabMachine* m, uint64_t seed);
+
+int              machine_dbg_json(RetrolabMachine* m, size_t memory_block, char* buf, size_t bufsz);
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
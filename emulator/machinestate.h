@@ -0,0 +1,142 @@
+#ifndef MACHINESTATE_H_
+#define MACHINESTATE_H_
+
+// Everything a retrolab machine is made of. Each module keeps its state in its own section, and
+// accesses it through `current_machine`, the machine selected in the running thread (see
+// machine.h). Only the emulator modules should include this file.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "breakpoints.h"
+#include "cpu.h"
+#include "decode.h"
+#include "framebuffer.h"
+#include "history.h"
+#include "interrupts.h"
+#include "profile.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#define MEMSZ  0x10000  // 64 kB
+
+typedef struct LastUpdated {
+    long addr;
+    long addr2;
+} LastUpdated;
+
+typedef struct RetrolabMachine {
+    struct {
+        reg_t               reg[16];
+        bool                skip_next;
+        bool                debugging_mode;
+        CpuError            error;
+        Interrupts          ints;
+        void              (*hw_fptr[256])(uint16_t data);
+        DebuggingInfo*      dbg;
+        bool                break_next;
+        DecodedInstruction  decoded[DECODE_CACHE_SZ];
+        uint64_t            random;     // CPU_RANDOM generator state
+        uint64_t            fused_steps; // see cpu_fused_steps
+        uint64_t            idle_steps;  // see cpu_idle_steps
+        uint32_t            stall;      // steps left of the device command being run (see memory_manager)
+    } cpu;
+
+    struct {
+        uint8_t             ram[MEMSZ];
+        LastUpdated         last_updated;
+        uint8_t             code_map[MEMSZ / 8];
+        uint8_t             watch_map[MEMSZ / 0x100];   // WatchKind flags of the watchpoints in each page
+    } memory;
+
+    struct {
+        bool                execution_suspended;
+        bool                end_of_frame;
+        void              (*breakpoint_hit_fptr)();
+        bool                break_at_end_of_frame;
+        uint64_t            frame_count;    // since the machine was created
+        bool                headless;       // no window: nothing is drawn, and there's no input
+    } emulator;
+
+    struct {
+        uint32_t*           pixels;     // NULL until the first frame is drawn
+        uint64_t            dirty[(FRAMEBUFFER_CELLS + 63) / 64];  // cells changed since, one bit each
+        bool                all_dirty;  // the border or the palette changed
+        int32_t             cursor;     // cell where the cursor was drawn, -1 if it wasn't
+        uint8_t             cursor_color;
+    } framebuffer;
+
+    struct {
+        uint64_t            now;        // steps executed since the machine was created
+        SchedulerEvent      heap[SCHED_EVENT_KINDS];
+        size_t              n_events;
+    } scheduler;
+
+    struct {
+        Breakpoint*         bkps;
+        size_t              n_bkps;
+        long                tmp_brk;
+        uint8_t             map[MEMSZ / 8];     // one bit per address with a breakpoint
+        Watchpoint*         watchpoints;
+        size_t              n_watchpoints;
+        WatchHit            last_hit;
+        bool                any_hit;
+        bool                triggered;
+    } breakpoints;
+
+    struct {
+        TraceRecord*        records;    // ring buffer, NULL when not tracing
+        size_t              mask;
+        size_t              written;
+        uint64_t            steps;
+    } trace;
+
+    struct {
+        uint8_t*            ring;
+        size_t              ring_sz;
+        size_t              ring_tail;
+        HistoryEntry*       frames;
+        int                 max_frames;
+        int                 oldest;
+        int                 n_frames;
+        struct Snapshot*    latest;
+        struct Snapshot*    scratch;
+        uint8_t*            encoded;
+        int                 keyframe_every;
+        int                 since_keyframe;
+    } history;
+
+    struct {
+        FILE*               recording;  // NULL when not recording
+        ReplayEvent*        events;     // NULL when not playing
+        size_t              n_events;
+        size_t              next_event;
+        uint64_t            start;      // emulator_cycles() when it started
+        uint8_t             input_phase;    // of the input being read now (see ReplayPhase)
+    } replay;
+
+    struct {
+        struct Recorder*    active;     // NULL when not recording video
+        uint64_t            dropped;    // frames dropped by the last recording
+    } recorder;
+
+#if PROFILE
+    Profile                 profile;
+#endif
+
+    struct JitState*        jit;
+} RetrolabMachine;
+
+extern _Thread_local RetrolabMachine* current_machine;
+
+// Any byte written to memory might, as far as the compiler knows, change `current_machine`, so it
+// gets reloaded from thread-local storage after each write. Hot functions can shadow it with a
+// local copy instead, by starting with USE_CURRENT_MACHINE().
+static inline RetrolabMachine* selected_machine() { return current_machine; }
+#define USE_CURRENT_MACHINE() RetrolabMachine* const current_machine = selected_machine()
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
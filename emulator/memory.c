@@ -3,19 +3,41 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "breakpoints.h"
 #include "cpu.h"
-#include "video.h"
+#include "framebuffer.h"
+#include "mmap.h"
 
-#define MEMSZ  0x10000  // 64 kB
+#define NO_ADDRESS -1
 
-uint8_t ram[MEMSZ];
+// memory state, in the machine currently selected (see machine.h)
+#define last_updated  (current_machine->memory.last_updated)
+#define code_map      (current_machine->memory.code_map)    // one bit per byte, set when the byte
+                                                            // belongs to a decoded instruction
+#define watch_map     (current_machine->memory.watch_map)
 
-typedef struct LastUpdated {
-    long addr;
-    long addr2;
-} LastUpdated;
-#define NO_ADDRESS -1
-LastUpdated last_updated = { NO_ADDRESS, NO_ADDRESS };
+static inline void
+check_code(uint16_t addr)
+{
+    if (code_map[addr >> 3] & (1 << (addr & 7)))
+        cpu_invalidate_code(addr);
+}
+
+// called after the byte is written
+static inline void
+check_video(uint16_t addr)
+{
+    if (addr >= VIDEO_BORDER)
+        framebuffer_touch(addr);
+}
+
+// called before the byte is written
+static inline void
+check_watch(uint16_t addr, uint8_t data)
+{
+    if (watch_map[addr >> 8] & (WATCH_WRITE | WATCH_CHANGE))
+        bkps_watch_access(addr, WATCH_WRITE, ram[addr], data);
+}
 
 void
 ram_init()
@@ -27,6 +49,9 @@ void
 ram_reset()
 {
     memset(ram, 0, MEMSZ);
+    memset(code_map, 0, sizeof code_map);
+    cpu_flush_code_cache();
+    framebuffer_invalidate();
     last_updated = (LastUpdated) { NO_ADDRESS, NO_ADDRESS };
 }
 
@@ -45,28 +70,37 @@ ram_get16(uint16_t addr)
 void
 ram_set(uint16_t addr, uint8_t data)
 {
+    USE_CURRENT_MACHINE();
+    check_watch(addr, data);
     ram[addr] = data;
+    check_code(addr);
+    check_video(addr);
     last_updated.addr = addr;
     last_updated.addr2 = NO_ADDRESS;
-    /*
-#if !HEADLESS
-    if (addr >= MMAP_VIDEO_START)
-        video_set(addr, data);
-#endif
-    */
 }
 
 void
 ram_set_bypass(uint16_t addr, uint8_t data)
 {
+    USE_CURRENT_MACHINE();
+    check_watch(addr, data);
     ram[addr] = data;
+    check_code(addr);
+    check_video(addr);
 }
 
 void
 ram_set16(uint16_t addr, uint16_t data)
 {
+    USE_CURRENT_MACHINE();
+    check_watch(addr, data & 0xff);
+    check_watch(addr + 1, data >> 8);
     ram[addr] = (data & 0xff);
-    ram[addr+1] = (data >> 8);
+    ram[(uint16_t) (addr + 1)] = (data >> 8);
+    check_code(addr);
+    check_code(addr + 1);
+    check_video(addr);
+    check_video(addr + 1);
     last_updated.addr = addr;
     last_updated.addr2 = addr + 1;
 }
@@ -77,9 +111,93 @@ ram_load(uint16_t start, const uint8_t* data, size_t sz)
     if (start + sz > 0xFFFF)
         return -1;
     memcpy(&ram[start], data, sz);
+    ram_written(start, sz);
     return sz;
 }
 
+void
+ram_restore(const uint8_t* data)
+{
+    memcpy(ram, data, MEMSZ);
+    memset(code_map, 0, sizeof code_map);
+    cpu_flush_code_cache();
+    framebuffer_invalidate();
+    last_updated = (LastUpdated) { NO_ADDRESS, NO_ADDRESS };
+}
+
+uint64_t
+ram_hash()
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < MEMSZ; ++i)
+        h = (h ^ ram[i]) * 0x100000001b3;
+    return h;
+}
+
+void
+ram_watch(uint16_t start, uint16_t end, uint8_t kinds)
+{
+    for (size_t page = start >> 8; page <= (size_t) (end >> 8); ++page)
+        watch_map[page] |= kinds;
+}
+
+void
+ram_unwatch_all()
+{
+    memset(watch_map, 0, sizeof watch_map);
+}
+
+void
+ram_track_code(uint16_t addr, uint8_t sz)
+{
+    USE_CURRENT_MACHINE();
+    for (uint16_t i = 0; i < sz; ++i) {
+        uint16_t a = addr + i;
+        code_map[a >> 3] |= (1 << (a & 7));
+    }
+}
+
+void
+ram_written(uint16_t start, size_t sz)
+{
+    for (size_t i = 0; i < sz; ++i) {
+        check_code(start + i);
+        check_video(start + i);
+    }
+}
+
+// first address of the page after `addr`, or `end` if it comes first
+static size_t
+page_end(size_t addr, size_t end)
+{
+    size_t next = (addr | 0xff) + 1;
+    return next < end ? next : end;
+}
+
+// Blocks are checked one page at a time, so pages without watchpoints are skipped in one go.
+
+void
+ram_reading(uint16_t start, size_t sz)
+{
+    for (size_t a = start, end = start + sz; a < end; a = page_end(a, end)) {
+        if (!(watch_map[a >> 8] & WATCH_READ))
+            continue;
+        for (size_t i = a; i < page_end(a, end); ++i)
+            bkps_watch_access(i, WATCH_READ, ram[i], ram[i]);
+    }
+}
+
+void
+ram_writing(uint16_t start, size_t sz, const uint8_t* data, size_t data_sz)
+{
+    for (size_t a = start, end = start + sz; a < end; a = page_end(a, end)) {
+        if (!(watch_map[a >> 8] & (WATCH_WRITE | WATCH_CHANGE)))
+            continue;
+        for (size_t i = a; i < page_end(a, end); ++i)
+            bkps_watch_access(i, WATCH_WRITE, ram[i], data[(i - start) % data_sz]);
+    }
+}
+
 int
 ram_dbg_json(size_t memory_block, char* buf, size_t bufsz)
 {
@@ -4,7 +4,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-extern uint8_t ram[];
+#include "machinestate.h"
+
+#define ram (current_machine->memory.ram)
+#define ram_watched(addr) (current_machine->memory.watch_map[(uint16_t) (addr) >> 8])   // WatchKind flags
 
 void     ram_init();
 void     ram_reset();
@@ -16,6 +19,19 @@ void     ram_set_bypass(uint16_t addr, uint8_t data);
 void     ram_set16(uint16_t addr, uint16_t data);
 
 int      ram_load(uint16_t start, const uint8_t* data, size_t sz);
+void     ram_restore(const uint8_t* data);     // whole memory, from a snapshot
+uint64_t ram_hash();                           // of the whole memory (FNV-1a)
+
+void     ram_watch(uint16_t start, uint16_t end, uint8_t kinds);   // pages with watchpoints (see breakpoints.h)
+void     ram_unwatch_all();
+
+void     ram_track_code(uint16_t addr, uint8_t sz);
+void     ram_written(uint16_t start, size_t sz);     // after writing a block straight into `ram`
+
+// Tell the watchpoints about a block read straight from `ram`, or about to be written into it (byte
+// `i` of the block gets `data[i % data_sz]`). The block must not go past the end of the memory.
+void     ram_reading(uint16_t start, size_t sz);
+void     ram_writing(uint16_t start, size_t sz, const uint8_t* data, size_t data_sz);
 
 int      ram_dbg_json(size_t memory_block, char* buf, size_t bufsz);
 
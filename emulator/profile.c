@@ -0,0 +1,129 @@
+#include "profile.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "machinestate.h"
+
+static const char* const mode_names[N_OPERAND_MODES] = {
+    [MODE_LITERAL]           = "literal",
+    [MODE_V8]                = "v8",
+    [MODE_V16]               = "v16",
+    [MODE_ADDR_V8]           = "[v8]",
+    [MODE_ADDR_V8_WORD]      = "^[v8]",
+    [MODE_ADDR_V16]          = "[v16]",
+    [MODE_ADDR_V16_WORD]     = "^[v16]",
+    [MODE_REG]               = "reg",
+    [MODE_ADDR_REG]          = "[reg]",
+    [MODE_ADDR_REG_WORD]     = "^[reg]",
+    [MODE_ADDR_REG_V8]       = "[reg+v8]",
+    [MODE_ADDR_REG_V8_WORD]  = "^[reg+v8]",
+    [MODE_ADDR_REG_V16]      = "[reg+v16]",
+    [MODE_ADDR_REG_V16_WORD] = "^[reg+v16]",
+};
+
+const char*
+profile_mode_name(OperandMode mode)
+{
+    return mode_names[mode];
+}
+
+#if PROFILE
+
+// profile state, in the machine currently selected (see machine.h)
+#define profile  (current_machine->profile)
+
+bool
+profile_enabled()
+{
+    return true;
+}
+
+void
+profile_reset()
+{
+    memset(&profile, 0, sizeof profile);
+}
+
+int
+profile_dump_csv(FILE* f)
+{
+    fprintf(f, "kind,opcode,operand,mode,count\n");
+    for (int op = 0; op < 256; ++op)
+        if (profile.opcodes[op])
+            fprintf(f, "opcode,%s,,,%llu\n", cpu_instruction_name(op), (unsigned long long) profile.opcodes[op]);
+    for (int m = 0; m < N_OPERAND_MODES; ++m)
+        if (profile.modes[m])
+            fprintf(f, "mode,,,%s,%llu\n", mode_names[m], (unsigned long long) profile.modes[m]);
+    for (int op = 0; op < 256; ++op)
+        for (int i = 0; i < 2; ++i)
+            for (int m = 0; m < N_OPERAND_MODES; ++m)
+                if (profile.pairs[op][i][m])
+                    fprintf(f, "pair,%s,%d,%s,%llu\n", cpu_instruction_name(op), i + 1, mode_names[m],
+                            (unsigned long long) profile.pairs[op][i][m]);
+    for (int op = 0; op < 256; ++op)
+        for (int next = 0; next < 256; ++next)
+            if (profile.sequences[op][next])
+                fprintf(f, "sequence,%s,,%s,%llu\n", cpu_instruction_name(op), cpu_instruction_name(next),
+                        (unsigned long long) profile.sequences[op][next]);
+    return ferror(f) ? -1 : 0;
+}
+
+int
+profile_dump_json(FILE* f)
+{
+    int comma = 0;
+    fprintf(f, "{\"opcodes\":{");
+    for (int op = 0; op < 256; ++op)
+        if (profile.opcodes[op])
+            fprintf(f, "%s\"%s\":%llu", comma++ ? "," : "", cpu_instruction_name(op), (unsigned long long) profile.opcodes[op]);
+    fprintf(f, "},\"modes\":{");
+    comma = 0;
+    for (int m = 0; m < N_OPERAND_MODES; ++m)
+        if (profile.modes[m])
+            fprintf(f, "%s\"%s\":%llu", comma++ ? "," : "", mode_names[m], (unsigned long long) profile.modes[m]);
+    fprintf(f, "},\"pairs\":[");
+    comma = 0;
+    for (int op = 0; op < 256; ++op)
+        for (int i = 0; i < 2; ++i)
+            for (int m = 0; m < N_OPERAND_MODES; ++m)
+                if (profile.pairs[op][i][m])
+                    fprintf(f, "%s{\"opcode\":\"%s\",\"operand\":%d,\"mode\":\"%s\",\"count\":%llu}", comma++ ? "," : "",
+                            cpu_instruction_name(op), i + 1, mode_names[m], (unsigned long long) profile.pairs[op][i][m]);
+    fprintf(f, "],\"sequences\":[");
+    comma = 0;
+    for (int op = 0; op < 256; ++op)
+        for (int next = 0; next < 256; ++next)
+            if (profile.sequences[op][next])
+                fprintf(f, "%s{\"opcode\":\"%s\",\"next\":\"%s\",\"count\":%llu}", comma++ ? "," : "",
+                        cpu_instruction_name(op), cpu_instruction_name(next), (unsigned long long) profile.sequences[op][next]);
+    fprintf(f, "]}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+#else
+
+bool profile_enabled()             { return false; }
+void profile_reset()               {}
+int  profile_dump_csv(FILE* f)     { (void) f; return -1; }
+int  profile_dump_json(FILE* f)    { (void) f; return -1; }
+
+#endif
+
+int
+profile_dump_file(const char* filename)
+{
+    if (!profile_enabled())
+        return -1;
+    FILE* f = fopen(filename, "w");
+    if (!f)
+        return -1;
+    size_t len = strlen(filename);
+    bool json = len >= 5 && strcmp(&filename[len - 5], ".json") == 0;
+    int r = json ? profile_dump_json(f) : profile_dump_csv(f);
+    if (fclose(f) != 0)
+        return -1;
+    return r;
+}
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -0,0 +1,50 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Execution histogram: how many times each opcode, each operand addressing mode, each
+// (opcode, operand, mode) combination, and each opcode right after another one was executed. The
+// counters are only compiled in with `cmake -DPROFILE=ON`; otherwise profile_enabled() returns
+// false and the dumps fail.
+
+typedef enum {
+    MODE_LITERAL,       // value in the operand byte
+    MODE_V8,
+    MODE_V16,
+    MODE_ADDR_V8,       // [v8]
+    MODE_ADDR_V8_WORD,  // ^[v8]
+    MODE_ADDR_V16,
+    MODE_ADDR_V16_WORD,
+    MODE_REG,
+    MODE_ADDR_REG,      // [reg]
+    MODE_ADDR_REG_WORD,
+    MODE_ADDR_REG_V8,   // [reg + v8]
+    MODE_ADDR_REG_V8_WORD,
+    MODE_ADDR_REG_V16,
+    MODE_ADDR_REG_V16_WORD,
+    N_OPERAND_MODES,
+} OperandMode;
+
+typedef struct Profile {
+    uint64_t opcodes[256];
+    uint64_t modes[N_OPERAND_MODES];
+    uint64_t pairs[256][2][N_OPERAND_MODES];    // opcode, operand (destination, origin), mode
+    uint64_t sequences[256][256];               // opcode, next opcode executed
+    uint8_t  last_op;
+    bool     any_op;                            // last_op is set
+} Profile;
+
+bool        profile_enabled();
+void        profile_reset();
+const char* profile_mode_name(OperandMode mode);
+
+int         profile_dump_csv(FILE* f);
+int         profile_dump_json(FILE* f);
+int         profile_dump_file(const char* filename);    // JSON if the filename ends in .json, CSV otherwise
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -0,0 +1,261 @@
+#include "recorder.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "machinestate.h"
+
+// recorder state, in the machine currently selected (see machine.h)
+#define active   (current_machine->recorder.active)
+#define dropped  (current_machine->recorder.dropped)
+
+#define FRAME_PIXELS  (FRAMEBUFFER_W * FRAMEBUFFER_H)
+
+typedef struct Slot {
+    bool     repeat;        // same as the previous frame: `pixels` is not set
+    uint32_t pixels[FRAME_PIXELS];
+} Slot;
+
+typedef struct Recorder {
+    FILE*           f;
+    bool            y4m;
+    bool            lossless;
+    pthread_t       thread;
+
+    // the queue: the emulator only writes `head`, the thread only writes `tail`
+    Slot            slots[RECORDER_QUEUE_SZ];
+    atomic_size_t   head;       // next slot to be filled
+    atomic_size_t   tail;       // next slot to be written to the file
+    atomic_bool     stopping;
+
+    // only to sleep until the other side moves: the thread while the queue is empty, the emulator
+    // while it's full (lossless recordings)
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;
+    pthread_cond_t  written;
+
+    // emulator side
+    uint64_t        last_hash;
+    bool            any_frame;
+
+    // thread side
+    uint8_t         frame[FRAME_PIXELS * 3];   // the last frame, converted
+    bool            error;
+} Recorder;
+
+static bool
+queue_empty(Recorder* r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    return atomic_load_explicit(&r->tail, memory_order_relaxed) == head;
+}
+
+static bool
+queue_full(Recorder* r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    return atomic_load_explicit(&r->head, memory_order_relaxed) - tail == RECORDER_QUEUE_SZ;
+}
+
+static void
+wake(Recorder* r, pthread_cond_t* cond)
+{
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// {{{ writer thread
+
+// BT.601, limited range, as most players expect
+static void
+convert_y4m(const uint32_t* pixels, uint8_t* out)
+{
+    uint8_t* y_plane = out;
+    uint8_t* u_plane = &out[FRAME_PIXELS];
+    uint8_t* v_plane = &out[FRAME_PIXELS * 2];
+    for (size_t i = 0; i < FRAME_PIXELS; ++i) {
+        int r = (pixels[i] >> 16) & 0xff, g = (pixels[i] >> 8) & 0xff, b = pixels[i] & 0xff;
+        y_plane[i] = (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        u_plane[i] = (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v_plane[i] = (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+static void
+convert_rgb(const uint32_t* pixels, uint8_t* out)
+{
+    for (size_t i = 0; i < FRAME_PIXELS; ++i) {
+        out[i * 3] = (uint8_t) (pixels[i] >> 16);
+        out[i * 3 + 1] = (uint8_t) (pixels[i] >> 8);
+        out[i * 3 + 2] = (uint8_t) pixels[i];
+    }
+}
+
+static void*
+writer(void* data)
+{
+    Recorder* r = data;
+    for (;;) {
+        bool stopping = atomic_load(&r->stopping);      // before looking at the queue, so nothing is left behind
+        if (queue_empty(r)) {
+            if (stopping)
+                return NULL;
+            pthread_mutex_lock(&r->lock);
+            while (queue_empty(r) && !atomic_load(&r->stopping))
+                pthread_cond_wait(&r->queued, &r->lock);
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        const Slot* slot = &r->slots[tail % RECORDER_QUEUE_SZ];
+        if (!slot->repeat)
+            (r->y4m ? convert_y4m : convert_rgb)(slot->pixels, r->frame);
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        if (r->lossless)
+            wake(r, &r->written);
+
+        if (r->y4m)
+            fputs("FRAME\n", r->f);
+        if (fwrite(r->frame, 1, sizeof r->frame, r->f) != sizeof r->frame)
+            r->error = true;
+    }
+}
+
+// }}}
+
+// {{{ emulator side
+
+static bool
+ends_with(const char* s, const char* suffix)
+{
+    size_t len = strlen(s), sfx = strlen(suffix);
+    return len >= sfx && strcmp(&s[len - sfx], suffix) == 0;
+}
+
+static void
+free_recorder(Recorder* r)
+{
+    pthread_cond_destroy(&r->written);
+    pthread_cond_destroy(&r->queued);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+int
+recorder_start(const char* filename, bool lossless)
+{
+    recorder_stop();
+    dropped = 0;
+
+    Recorder* r = calloc(1, sizeof(Recorder));
+    if (!r)
+        return -1;
+    r->f = fopen(filename, "wb");
+    if (!r->f) {
+        free(r);
+        return -1;
+    }
+    r->y4m = ends_with(filename, ".y4m");
+    r->lossless = lossless;
+    if (r->y4m)
+        fprintf(r->f, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", FRAMEBUFFER_W, FRAMEBUFFER_H);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->stopping, false);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->queued, NULL);
+    pthread_cond_init(&r->written, NULL);
+
+    if (pthread_create(&r->thread, NULL, writer, r) != 0) {
+        fclose(r->f);
+        free_recorder(r);
+        return -1;
+    }
+    active = r;
+    return 0;
+}
+
+bool
+recorder_recording()
+{
+    return active != NULL;
+}
+
+uint64_t
+recorder_dropped()
+{
+    return dropped;
+}
+
+// FNV-1a, 64 bits at a time
+static uint64_t
+hash(const uint32_t* pixels)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < FRAME_PIXELS; i += 2) {
+        uint64_t v;
+        memcpy(&v, &pixels[i], sizeof v);
+        h = (h ^ v) * 0x100000001b3;
+    }
+    return h;
+}
+
+void
+recorder_frame()
+{
+    Recorder* r = active;
+    if (!r)
+        return;
+    framebuffer_update();
+    const uint32_t* pixels = framebuffer_pixels();
+    if (!pixels)
+        return;
+    uint64_t h = hash(pixels);
+
+    if (queue_full(r)) {
+        if (!r->lossless) {
+            ++dropped;
+            return;
+        }
+        pthread_mutex_lock(&r->lock);
+        while (queue_full(r))
+            pthread_cond_wait(&r->written, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+    }
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    Slot* slot = &r->slots[head % RECORDER_QUEUE_SZ];
+    slot->repeat = r->any_frame && h == r->last_hash;
+    if (!slot->repeat)
+        memcpy(slot->pixels, pixels, sizeof slot->pixels);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    wake(r, &r->queued);
+    r->last_hash = h;
+    r->any_frame = true;
+}
+
+int
+recorder_stop()
+{
+    Recorder* r = active;
+    if (!r)
+        return 0;
+    atomic_store(&r->stopping, true);
+    wake(r, &r->queued);
+    pthread_join(r->thread, NULL);
+    bool ok = !r->error;
+    if (fclose(r->f) != 0)
+        ok = false;
+    free_recorder(r);
+    active = NULL;
+    return ok ? 0 : -1;
+}
+
+// }}}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
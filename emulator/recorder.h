@@ -0,0 +1,30 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Video recording: the screen at the end of each frame (see framebuffer.h), as a Y4M video (*.y4m,
+// 4:4:4, 60 fps) or as raw RGB24 frames for any other file name. It works the same with and
+// without a window.
+//
+// Frames are copied into a lock-free single producer, single consumer queue, and converted and
+// written by a background thread, so the emulation doesn't wait for the disk. The thread sleeps on a
+// condition variable while the queue is empty, and each frame queued wakes it up. A frame that is the
+// same as the previous one (same hash) is not copied: the thread writes the last one again.
+//
+// When the queue is full, frames are dropped, unless the recording is lossless: then the emulator
+// waits for the thread. Runs without a window don't need to keep up with real time, so they should
+// record losslessly.
+
+#define RECORDER_QUEUE_SZ  16      // frames
+
+int      recorder_start(const char* filename, bool lossless);
+void     recorder_frame();          // called at the end of each frame
+int      recorder_stop();           // waits for the frames queued; returns -1 if they couldn't be written
+bool     recorder_recording();
+uint64_t recorder_dropped();        // frames dropped because the queue was full
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
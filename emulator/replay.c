@@ -0,0 +1,235 @@
+#include "replay.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "machinestate.h"
+#include "memory.h"
+
+// replay state, in the machine currently selected (see machine.h)
+#define recording   (current_machine->replay.recording)
+#define events      (current_machine->replay.events)
+#define n_events    (current_machine->replay.n_events)
+#define next_event  (current_machine->replay.next_event)
+#define start       (current_machine->replay.start)
+#define input_phase (current_machine->replay.input_phase)
+
+static uint64_t
+now()
+{
+    return emulator_cycles() - start;
+}
+
+// {{{ recording
+
+int
+replay_record(const char* filename, uint64_t seed)
+{
+    replay_stop();
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+    ReplayHeader h = {
+        .magic          = "RLREPLAY",
+        .version        = REPLAY_VERSION,
+        .event_size     = sizeof(ReplayEvent),
+        .seed           = seed,
+        .memory_hash    = ram_hash(),
+        .frame_position = emulator_frame_position(),
+    };
+    if (fwrite(&h, sizeof h, 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    cpu_set_random_seed(seed);
+    recording = f;
+    start = emulator_cycles();
+    input_phase = REPLAY_BETWEEN_STEPS;
+    return 0;
+}
+
+bool
+replay_recording()
+{
+    return recording != NULL;
+}
+
+static void
+record(ReplayEventKind kind, uint16_t a, uint16_t b)
+{
+    ReplayEvent e = { .cycle = now(), .kind = kind, .phase = input_phase, .a = a, .b = b };
+    fwrite(&e, sizeof e, 1, recording);
+}
+
+// }}}
+
+// {{{ playing
+
+int
+replay_play(const char* filename)
+{
+    replay_stop();
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return -1;
+    ReplayHeader h;
+    if (fread(&h, sizeof h, 1, f) != 1
+            || memcmp(h.magic, "RLREPLAY", sizeof h.magic) != 0
+            || h.version != REPLAY_VERSION
+            || h.event_size != sizeof(ReplayEvent)
+            || h.memory_hash != ram_hash()) {
+        fclose(f);
+        return -1;
+    }
+
+    size_t capacity = 256;
+    events = malloc(capacity * sizeof(ReplayEvent));
+    while (events && fread(&events[n_events], sizeof(ReplayEvent), 1, f) == 1) {
+        if (events[n_events++].kind == REPLAY_END)
+            break;
+        if (n_events == capacity) {
+            capacity *= 2;
+            ReplayEvent* e = realloc(events, capacity * sizeof(ReplayEvent));
+            if (!e)
+                free(events);
+            events = e;
+        }
+    }
+    fclose(f);
+    if (!events || n_events == 0 || events[n_events - 1].kind != REPLAY_END) {
+        replay_stop();
+        return -1;
+    }
+
+    cpu_set_random_seed(h.seed);
+    emulator_set_frame_position(h.frame_position);
+    start = emulator_cycles();
+    return 0;
+}
+
+bool
+replay_playing()
+{
+    return events != NULL;
+}
+
+bool
+replay_finished()
+{
+    return events && events[next_event].kind == REPLAY_END && now() >= events[next_event].cycle;
+}
+
+// Delivers the events due by now. Events that happened in another phase of the same cycle wait
+// until that phase comes.
+static void
+deliver(ReplayPhase current)
+{
+    uint64_t cycle = now();
+    for (; events[next_event].kind != REPLAY_END; ++next_event) {
+        const ReplayEvent* e = &events[next_event];
+        if (e->cycle > cycle || (e->cycle == cycle && e->phase != current))
+            break;
+        switch (e->kind) {
+            case REPLAY_INTERRUPT:
+                cpu_interrupt(e->a, e->b);
+                break;
+            case REPLAY_RAM:
+                ram_set_bypass(e->a, e->b);
+                break;
+        }
+    }
+}
+
+EmulatorStop
+replay_run_cycles(int cycles, unsigned stop_mask)
+{
+    if (!events)
+        return emulator_run_cycles(cycles, stop_mask);
+
+    while (cycles > 0) {
+        deliver(REPLAY_BETWEEN_STEPS);
+
+        // stop right before the next event, unless it's delivered by the end of the frame
+        const ReplayEvent* e = &events[next_event];
+        int chunk = cycles;
+        if (e->kind == REPLAY_END || e->phase == REPLAY_BETWEEN_STEPS) {
+            uint64_t due = e->cycle - now();
+            if (due == 0)
+                return EMULATOR_STOP_NONE;      // the end of the replay
+            if (due < (uint64_t) chunk)
+                chunk = (int) due;
+        }
+
+        uint64_t before = emulator_cycles();
+        EmulatorStop stop = emulator_run_cycles(chunk, stop_mask);
+        cycles -= (int) (emulator_cycles() - before);
+        if (stop != EMULATOR_STOP_NONE)
+            return stop;
+    }
+    deliver(REPLAY_BETWEEN_STEPS);
+    return EMULATOR_STOP_NONE;
+}
+
+CpuError
+replay_run()
+{
+    while (events && !replay_finished())
+        if (replay_run_cycles(INT_MAX, 0) == EMULATOR_STOP_ERROR)
+            break;
+    return cpu_error();
+}
+
+// }}}
+
+// {{{ input from the host
+
+void
+replay_input_interrupt(uint8_t number, uint16_t xt_value)
+{
+    if (events)
+        return;
+    if (recording)
+        record(REPLAY_INTERRUPT, number, xt_value);
+    cpu_interrupt(number, xt_value);
+}
+
+void
+replay_input_ram(uint16_t addr, uint8_t data)
+{
+    if (events || ram[addr] == data)
+        return;
+    if (recording)
+        record(REPLAY_RAM, addr, data);
+    ram_set_bypass(addr, data);
+}
+
+void
+replay_frame_input_begin()
+{
+    input_phase = REPLAY_FRAME_END;
+    if (events)
+        deliver(REPLAY_FRAME_END);
+}
+
+void
+replay_frame_input_end()
+{
+    input_phase = REPLAY_BETWEEN_STEPS;
+}
+
+// }}}
+
+void
+replay_stop()
+{
+    if (recording) {
+        record(REPLAY_END, 0, 0);
+        fclose(recording);
+    }
+    free(events);
+    memset(&current_machine->replay, 0, sizeof current_machine->replay);
+}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
@@ -0,0 +1,77 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Input record and replay. Everything else the machine does is deterministic, so a run can be
+// reproduced exactly from the same program, the CPU_RANDOM seed, the position in the frame where it
+// started and the input it got from the host (keys, joystick), each one with the cycle it happened
+// in (see emulator_cycles).
+//
+// All the input from the host must go through replay_input_*, so it can be recorded. While a
+// replay is being played, the input from the host is ignored. Resetting the machine, restoring
+// snapshots or rewinding (see history.h) while recording makes the replay invalid.
+//
+// File format: a ReplayHeader followed by ReplayEvents, ending with a REPLAY_END one. Files are
+// only portable between builds with the same byte order and REPLAY_VERSION.
+
+#define REPLAY_VERSION  1
+
+typedef enum {
+    REPLAY_INTERRUPT = 1,   // a = interrupt number, b = XT
+    REPLAY_RAM,             // a = address, b = byte written
+    REPLAY_END,             // when the recording stopped
+} ReplayEventKind;
+
+// When, in the cycle, the event happened. The SDL frontend reads the input at the end of each
+// frame, before the timers are updated, and that is when it must be delivered again.
+typedef enum {
+    REPLAY_BETWEEN_STEPS = 0,
+    REPLAY_FRAME_END,
+} ReplayPhase;
+
+typedef struct ReplayHeader {
+    char        magic[8];       // "RLREPLAY"
+    uint32_t    version;
+    uint32_t    event_size;     // sizeof(ReplayEvent)
+    uint64_t    seed;           // CPU_RANDOM seed
+    uint64_t    memory_hash;    // of the memory when the recording started
+    uint32_t    frame_position; // steps already executed in the frame when the recording started
+    uint32_t    reserved;
+} ReplayHeader;
+
+typedef struct ReplayEvent {
+    uint64_t    cycle;          // since the recording started
+    uint8_t     kind;           // ReplayEventKind
+    uint8_t     phase;          // ReplayPhase
+    uint16_t    a;
+    uint16_t    b;
+    uint16_t    reserved;
+} ReplayEvent;
+
+int          replay_record(const char* filename, uint64_t seed);   // sets the seed and starts recording
+int          replay_play(const char* filename);     // -1 if invalid, or recorded from a different program
+void         replay_stop();
+bool         replay_recording();
+bool         replay_playing();
+bool         replay_finished();     // the replay reached the cycle the recording stopped
+
+// input from the host
+void         replay_input_interrupt(uint8_t number, uint16_t xt_value);
+void         replay_input_ram(uint16_t addr, uint8_t data);
+
+// Same as emulator_run_cycles, but stops at each recorded event to deliver it, and at the end of
+// the replay.
+EmulatorStop replay_run_cycles(int cycles, unsigned stop_mask);
+CpuError     replay_run();          // runs the whole replay, as fast as possible
+
+void         replay_frame_input_begin();    // called by the emulator around the input read at the
+void         replay_frame_input_end();      // end of each frame (see ReplayPhase)
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
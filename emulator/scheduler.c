@@ -0,0 +1,123 @@
+#include "scheduler.h"
+
+#include "machinestate.h"
+
+// scheduler state, in the machine currently selected (see machine.h)
+#define now         (current_machine->scheduler.now)
+#define heap        (current_machine->scheduler.heap)
+#define n_events    (current_machine->scheduler.n_events)
+
+// {{{ heap
+
+static bool
+before(const SchedulerEvent* a, const SchedulerEvent* b)
+{
+    return a->cycle < b->cycle || (a->cycle == b->cycle && a->kind < b->kind);
+}
+
+static void
+swap(size_t i, size_t j)
+{
+    SchedulerEvent e = heap[i];
+    heap[i] = heap[j];
+    heap[j] = e;
+}
+
+static void
+sift_up(size_t i)
+{
+    while (i > 0 && before(&heap[i], &heap[(i - 1) / 2])) {
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+sift_down(size_t i)
+{
+    for (;;) {
+        size_t first = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n_events && before(&heap[l], &heap[first]))
+            first = l;
+        if (r < n_events && before(&heap[r], &heap[first]))
+            first = r;
+        if (first == i)
+            return;
+        swap(i, first);
+        i = first;
+    }
+}
+
+static void
+remove_at(size_t i)
+{
+    heap[i] = heap[--n_events];
+    if (i < n_events) {
+        sift_up(i);
+        sift_down(i);
+    }
+}
+
+static long
+find(SchedulerEventKind kind)
+{
+    for (size_t i = 0; i < n_events; ++i)
+        if (heap[i].kind == kind)
+            return (long) i;
+    return -1;
+}
+
+// }}}
+
+uint64_t
+scheduler_now()
+{
+    return now;
+}
+
+void
+scheduler_advance(uint64_t cycles)
+{
+    now += cycles;
+}
+
+void
+scheduler_add(SchedulerEventKind kind, uint64_t cycle)
+{
+    scheduler_remove(kind);
+    heap[n_events] = (SchedulerEvent) { cycle, kind };
+    sift_up(n_events++);
+}
+
+void
+scheduler_remove(SchedulerEventKind kind)
+{
+    long i = find(kind);
+    if (i >= 0)
+        remove_at((size_t) i);
+}
+
+uint64_t
+scheduler_when(SchedulerEventKind kind)
+{
+    long i = find(kind);
+    return i >= 0 ? heap[i].cycle : SCHEDULER_NEVER;
+}
+
+uint64_t
+scheduler_next()
+{
+    return n_events > 0 ? heap[0].cycle : SCHEDULER_NEVER;
+}
+
+int
+scheduler_pop_due()
+{
+    if (n_events == 0 || heap[0].cycle > now)
+        return -1;
+    int kind = heap[0].kind;
+    remove_at(0);
+    return kind;
+}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
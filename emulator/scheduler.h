@@ -0,0 +1,39 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cycle scheduler: the things that happen at a given cycle (see emulator_cycles) instead of after
+// each instruction, like the end of each frame. The emulator runs the CPU freely until the next
+// event is due, so nothing is checked between steps, and an idle CPU (see cpu_run) skips straight
+// to it.
+//
+// Events are kept in a min-heap, ordered by cycle and then by kind, so events due in the same cycle
+// always run in the order of SchedulerEventKind. There's at most one event of each kind.
+
+#define SCHEDULER_NEVER  UINT64_MAX
+
+typedef enum {
+    SCHED_END_OF_FRAME = 0,     // input, video
+    SCHED_TIMERS,               // frame timers (TIMER_FRAME_n)
+    SCHED_EVENT_KINDS,
+} SchedulerEventKind;
+
+typedef struct SchedulerEvent {
+    uint64_t cycle;
+    uint8_t  kind;              // SchedulerEventKind
+} SchedulerEvent;
+
+uint64_t scheduler_now();
+void     scheduler_advance(uint64_t cycles);
+
+void     scheduler_add(SchedulerEventKind kind, uint64_t cycle);  // replaces the one of the same kind
+void     scheduler_remove(SchedulerEventKind kind);
+uint64_t scheduler_when(SchedulerEventKind kind);   // SCHEDULER_NEVER if it's not scheduled
+uint64_t scheduler_next();                          // cycle of the next event, or SCHEDULER_NEVER
+int      scheduler_pop_due();                       // removes and returns the next event due, or -1
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
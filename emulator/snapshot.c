@@ -0,0 +1,70 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "emulator.h"
+
+bool
+snapshot_valid(const Snapshot* s)
+{
+    return memcmp(s->magic, "RLSS", sizeof s->magic) == 0
+        && s->version == SNAPSHOT_VERSION
+        && s->size == sizeof(Snapshot);
+}
+
+int
+snapshot_save(const char* filename)
+{
+    Snapshot* s = malloc(sizeof(Snapshot));
+    if (!s)
+        return -1;
+    emulator_snapshot(s);
+
+    int r = -1;
+    FILE* f = fopen(filename, "wb");
+    if (f) {
+        if (fwrite(s, sizeof(Snapshot), 1, f) == 1)
+            r = 0;
+        if (fclose(f) != 0)
+            r = -1;
+    }
+    free(s);
+    return r;
+}
+
+const Snapshot*
+snapshot_map(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != sizeof(Snapshot)) {
+        close(fd);
+        return NULL;
+    }
+    void* p = mmap(NULL, sizeof(Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (!snapshot_valid(p)) {
+        munmap(p, sizeof(Snapshot));
+        return NULL;
+    }
+    return p;
+}
+
+void
+snapshot_unmap(const Snapshot* s)
+{
+    if (s)
+        munmap((void *) s, sizeof(Snapshot));
+}
+
+// vim:st=4:sts=4:sw=4:expandtab
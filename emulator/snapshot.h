@@ -0,0 +1,44 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "interrupts.h"
+
+// A savestate: everything needed to resume the emulated machine exactly where it was (memory, which
+// includes the timers, registers, interrupts, CPU_RANDOM generator and frame position). Debugger
+// state (breakpoints, debugging info), devices and traces belong to the host and are not saved.
+//
+// The layout is the same in memory and on disk, so a file written by snapshot_save can be mapped
+// with snapshot_map and restored without parsing. Files are only portable between builds with the
+// same byte order and SNAPSHOT_VERSION.
+
+#define SNAPSHOT_VERSION  2
+
+typedef struct Snapshot {
+    char        magic[4];       // "RLSS"
+    uint32_t    version;
+    uint32_t    size;           // sizeof(Snapshot)
+    int32_t     frame_steps;    // left until the end of the frame
+    struct {
+        reg_t       registers[16];
+        Interrupts  interrupts;
+        uint64_t    random;
+        uint8_t     skip;
+        uint8_t     error;
+        uint32_t    stall;
+    } cpu;
+    uint8_t     memory[0x10000];
+} Snapshot;
+
+bool            snapshot_valid(const Snapshot* s);
+
+int             snapshot_save(const char* filename);        // saves the selected machine
+const Snapshot* snapshot_map(const char* filename);         // NULL if it can't be read or is invalid
+void            snapshot_unmap(const Snapshot* s);
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
@@ -0,0 +1,178 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "machinestate.h"
+#include "memory.h"
+
+// trace state, in the machine currently selected (see machine.h)
+#define ring      (current_machine->trace.records)
+#define ring_mask (current_machine->trace.mask)       // ring size - 1
+#define written   (current_machine->trace.written)    // records written since the trace started
+#define steps     (current_machine->trace.steps)
+
+static const char magic[8] = "RLTRACE\1";
+
+// {{{ recording
+
+void
+trace_start(size_t n_records)
+{
+    size_t sz = 2;
+    while (sz < n_records)
+        sz <<= 1;
+    free(ring);
+    ring = calloc(sz, sizeof(TraceRecord));
+    ring_mask = ring ? sz - 1 : 0;
+    written = 0;
+    steps = 0;
+}
+
+void
+trace_stop()
+{
+    free(ring);
+    ring = NULL;
+    ring_mask = 0;
+    written = 0;
+}
+
+bool
+trace_enabled()
+{
+    return ring != NULL;
+}
+
+TraceRecord*
+trace_begin(uint8_t flags)
+{
+    USE_CURRENT_MACHINE();
+    TraceRecord* t = &ring[written++ & ring_mask];
+    reg_t pc = current_machine->cpu.reg[0xe];
+    t->cycle = steps;
+    t->pc = pc;
+    t->flags = flags;
+    for (size_t i = 0; i < MAX_INSTRUCTION_SZ; ++i)
+        t->bytes[i] = ram[(reg_t) (pc + i)];
+    return t;
+}
+
+void
+trace_end(TraceRecord* t, const reg_t* before)
+{
+    USE_CURRENT_MACHINE();
+    const reg_t* reg = current_machine->cpu.reg;
+    int n = 0;
+    t->changed = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (i == 0xe || reg[i] == before[i])
+            continue;
+        t->changed |= (1 << i);
+        if (n < TRACE_MAX_VALUES)
+            t->values[n++] = reg[i];
+    }
+}
+
+void
+trace_count(int n)
+{
+    steps += n;
+}
+
+// }}}
+
+// {{{ dumping
+
+static size_t
+filled()
+{
+    return written < ring_mask + 1 ? written : ring_mask + 1;
+}
+
+size_t
+trace_records(TraceRecord* out, size_t max)
+{
+    if (!ring)
+        return 0;
+    size_t n = filled();
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; ++i)
+        out[i] = ring[(written - n + i) & ring_mask];
+    return n;
+}
+
+int
+trace_dump(FILE* f)
+{
+    if (!ring)
+        return -1;
+    uint32_t header[2] = { sizeof(TraceRecord), filled() };
+    if (fwrite(magic, sizeof magic, 1, f) != 1 || fwrite(header, sizeof header, 1, f) != 1)
+        return -1;
+    for (size_t i = 0; i < header[1]; ++i)
+        if (fwrite(&ring[(written - header[1] + i) & ring_mask], sizeof(TraceRecord), 1, f) != 1)
+            return -1;
+    return 0;
+}
+
+int
+trace_dump_file(const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+    int r = trace_dump(f);
+    if (fclose(f) != 0)
+        return -1;
+    return r;
+}
+
+// }}}
+
+// {{{ decoding
+
+// Disassembles a dump written by trace_dump, one line per record. Registers changed by each step
+// are listed after the instruction.
+int
+trace_decode(FILE* in, FILE* out)
+{
+    char m[sizeof magic];
+    uint32_t header[2];
+    if (fread(m, sizeof m, 1, in) != 1 || memcmp(m, magic, sizeof magic) != 0)
+        return -1;
+    if (fread(header, sizeof header, 1, in) != 1 || header[0] != sizeof(TraceRecord))
+        return -1;
+
+    TraceRecord t;
+    for (uint32_t i = 0; i < header[1]; ++i) {
+        if (fread(&t, sizeof t, 1, in) != 1)
+            return -1;
+
+        char buf[50];
+        if (t.flags & TRACE_INTERRUPT)
+            snprintf(buf, sizeof buf, "(interrupt)");
+        else
+            cpu_disassemble(t.bytes, buf, sizeof buf);
+        fprintf(out, "%10llu  0x%04X  %s%-30s", (unsigned long long) t.cycle, t.pc,
+                (t.flags & TRACE_SKIPPED) ? "-" : " ", buf);
+
+        int n = 0;
+        for (int r = 0; r < 16; ++r) {
+            if (!(t.changed & (1 << r)))
+                continue;
+            if (n < TRACE_MAX_VALUES)
+                fprintf(out, " %s=0x%04X", cpu_register_name(r), t.values[n]);
+            else
+                fprintf(out, " %s", cpu_register_name(r));
+            ++n;
+        }
+        fprintf(out, "\n");
+    }
+    return 0;
+}
+
+// }}}
+
+// vim:st=4:sts=4:sw=4:expandtab:foldmethod=marker
@@ -0,0 +1,50 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+#include "decode.h"
+
+// CPU trace: while tracing, every step leaves a compact binary record in a fixed-size ring buffer,
+// so the last steps before a crash can be dumped to a file and disassembled later (trace_decode).
+// Unlike the debugging mode, nothing is formatted while the CPU runs.
+
+#define TRACE_DEFAULT_SZ  0x10000   // records (2 MB)
+#define TRACE_MAX_VALUES  6
+
+typedef enum {
+    TRACE_SKIPPED    = 1 << 0,  // the instruction was skipped by a previous IFxx
+    TRACE_INTERRUPT  = 1 << 1,  // not an instruction: the CPU entered an interrupt handler
+} TraceFlags;
+
+typedef struct TraceRecord {
+    uint64_t cycle;                         // CPU step, counted from when the trace started
+    reg_t    pc;
+    uint16_t changed;                       // registers changed by the step (one bit each, PC excluded)
+    uint8_t  bytes[MAX_INSTRUCTION_SZ];     // opcode and operand bytes
+    uint8_t  flags;                         // TraceFlags
+    reg_t    values[TRACE_MAX_VALUES];      // new values of the first changed registers
+} TraceRecord;
+
+void   trace_start(size_t n_records);       // rounded up to a power of two
+void   trace_stop();
+bool   trace_enabled();
+
+size_t trace_records(TraceRecord* out, size_t max);    // copies the latest records, oldest first
+int    trace_dump(FILE* f);
+int    trace_dump_file(const char* filename);
+int    trace_decode(FILE* in, FILE* out);
+
+// used by the CPU while tracing: a record for each instruction executed, and the step count (each
+// step executes one instruction, or two when the second is skipped)
+TraceRecord* trace_begin(uint8_t flags);
+void         trace_end(TraceRecord* t, const reg_t* before);
+void         trace_count(int steps);
+
+#endif
+
+// vim:st=4:sts=4:sw=4:expandtab
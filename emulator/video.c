@@ -4,6 +4,7 @@
 #include <SDL2/SDL.h>
 
 #include "font.h"
+#include "framebuffer.h"
 #include "keyboard.h"
 #include "joystick.h"
 #include "memory.h"
@@ -23,6 +24,8 @@ static SDL_Renderer* ren     = NULL;
 static bool          running = true;
 static double        zoom    = 2.0;
 static SDL_Texture*  font    = NULL;
+static SDL_Texture*  screen  = NULL;     // streaming texture, updated from the framebuffer
+static bool          draw_calls = false; // draw each cell with SDL calls, instead of the framebuffer
 
 typedef struct CursorInfo {
     struct Cursor {
@@ -35,7 +38,7 @@ typedef struct CursorInfo {
     uint16_t pos;
 } CursorInfo;
 
-static void draw_frame();
+static bool draw_frame();
 
 // {{{ initialization
 
@@ -55,34 +58,9 @@ load_font() {
 void
 video_reset()
 {
-#define SET_COLOR(n, color) \
-    ram[VIDEO_PALETTE + (n * 3)] = (color >> 16) & 0xff; \
-    ram[VIDEO_PALETTE + (n * 3) + 1] = (color >> 8) & 0xff; \
-    ram[VIDEO_PALETTE + (n * 3) + 2] = color & 0xff;
-
-    // palette - https://lospec.com/palette-list/sweetie-16
-    SET_COLOR(COLOR_BLACK,      0x1a1c2c)
-    SET_COLOR(COLOR_PURPLE,     0x5d275d)
-    SET_COLOR(COLOR_RED,        0xb13e53)
-    SET_COLOR(COLOR_ORANGE,     0xef7d57)
-    SET_COLOR(COLOR_YELLOW,     0xffcd75)
-    SET_COLOR(COLOR_LIME,       0xa7f070)
-    SET_COLOR(COLOR_GREEN,      0x38b764)
-    SET_COLOR(COLOR_TURQUOISE,  0x257179)
-    SET_COLOR(COLOR_DARK_BLUE,  0x29366f)
-    SET_COLOR(COLOR_BLUE,       0x3b5dc9)
-    SET_COLOR(COLOR_LIGHT_BLUE, 0x41a6f6)
-    SET_COLOR(COLOR_CYAN,       0x73eff7)
-    SET_COLOR(COLOR_WHITE,      0xf4f4f4)
-    SET_COLOR(COLOR_LIGHT_GRAY, 0x94b0c2)
-    SET_COLOR(COLOR_GRAY,       0x566c86)
-    SET_COLOR(COLOR_DARK_GRAY,  0x333c57)
-
-    // text color
-    memset(&ram[VIDEO_TXT_COLOR], (COLOR_LIME << 4) | COLOR_BLACK, LINES * COLUMNS);
-    ram[VIDEO_CURSOR_INFO] = (1 << 4) | COLOR_ORANGE;  // visible, whole, non-blinking, orange
-
-    draw_frame();
+    framebuffer_reset();
+    if (ren)    // there's no window when running headless
+        draw_frame();
 }
 
 void
@@ -96,6 +74,7 @@ video_init()
         (int) ((SCREEN_H + (BORDER * 2)) * 2 * zoom),
         SDL_WINDOW_SHOWN | SDL_WINDOW_OPENGL);
     ren = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    screen = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, FRAMEBUFFER_W, FRAMEBUFFER_H);
     load_font();
     video_reset();
     SDL_StartTextInput();
@@ -107,6 +86,8 @@ video_destroy()
     SDL_EventState(SDL_TEXTINPUT, SDL_DISABLE);
     SDL_EventState(SDL_KEYDOWN, SDL_DISABLE);
     SDL_EventState(SDL_KEYUP, SDL_DISABLE);
+    SDL_DestroyTexture(screen);
+    SDL_DestroyTexture(font);
     SDL_DestroyRenderer(ren);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -118,6 +99,12 @@ video_running()
     return running;
 }
 
+void
+video_set_draw_calls(bool v)
+{
+    draw_calls = v;
+}
+
 // }}}
 
 // {{{ events
@@ -143,6 +130,9 @@ do_events()
             case SDL_TEXTINPUT:
                 keyboard_interrupt(&e);
                 break;
+            case SDL_WINDOWEVENT:
+                framebuffer_invalidate();   // the window might need to be drawn again
+                break;
         }
     }
 }
@@ -230,13 +220,25 @@ cursor_info()
     return info;
 }
 
-static void
+// The screen is drawn in memory (see framebuffer.h) and uploaded in one go, instead of one SDL call
+// per cell, which is slow on software renderers. The SDL calls are kept for comparison. Returns
+// false if nothing changed since the last frame, so there's nothing to present.
+static bool
 draw_frame()
 {
-    CursorInfo cursor = cursor_info();
-    draw_border();
-    draw_background();
-    draw_text(&cursor);
+    if (draw_calls) {
+        CursorInfo cursor = cursor_info();
+        draw_border();
+        draw_background();
+        draw_text(&cursor);
+        return true;
+    }
+    if (!framebuffer_update())
+        return false;
+    SDL_UpdateTexture(screen, NULL, framebuffer_pixels(), FRAMEBUFFER_W * sizeof(uint32_t));
+    SDL_RenderSetScale(ren, 1, 1);
+    SDL_RenderCopy(ren, screen, NULL, NULL);
+    return true;
 }
 
 // }}}
@@ -245,15 +247,8 @@ void
 video_tick()
 {
     do_events();
-    draw_frame();
-    SDL_RenderPresent(ren);
-}
-
-void
-video_set(uint16_t addr, uint8_t data)
-{
-    (void) addr;
-    (void) data;
+    if (draw_frame())
+        SDL_RenderPresent(ren);
 }
 
 // {{{ debugging
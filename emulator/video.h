@@ -11,8 +11,7 @@ void video_reset();
 
 void video_tick();
 bool video_running();
-
-void video_set(uint16_t addr, uint8_t data);
+void video_set_draw_calls(bool v);      // draw with one SDL call per cell (slower, for comparison)
 
 int  video_dbg_json(char* buf, size_t bufsz);
 
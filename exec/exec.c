@@ -55,32 +55,41 @@ static char* read_file_contents(const char* full_path) {
     return content;
 }
 
-int exec_compile_dir_to_ram(const char* filename)
+Input* exec_input_from_dir(const char* dirname)
 {
     DIR* dp;
     struct dirent *ep;
-    dp = opendir(filename);
+    dp = opendir(dirname);
     if (dp == NULL) {
         fprintf(stderr, "Could not open source directory.\n");
-        return 1;
-    } else {
-        Input* input = input_new();
-        size_t plen = strlen(filename);
-        while ((ep = readdir(dp))) {
-            if (ep->d_type != DT_DIR && strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0) {
-                char full_path[plen + strlen(ep->d_name) + 2];
-                snprintf(full_path, sizeof full_path, "%s/%s", filename, ep->d_name);
-                char* contents = read_file_contents(full_path);
-                if (!contents) {
-                    closedir(dp);
-                    return 1;
-                }
-                input_add_file(input, full_path, contents);
-                free(contents);
+        return NULL;
+    }
+    Input* input = input_new();
+    size_t plen = strlen(dirname);
+    while ((ep = readdir(dp))) {
+        if (ep->d_type != DT_DIR && strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0) {
+            char full_path[plen + strlen(ep->d_name) + 2];
+            snprintf(full_path, sizeof full_path, "%s/%s", dirname, ep->d_name);
+            char* contents = read_file_contents(full_path);
+            if (!contents) {
+                closedir(dp);
+                input_free(input);
+                return NULL;
             }
+            input_add_file(input, full_path, contents);
+            free(contents);
         }
-        closedir(dp);
+    }
+    closedir(dp);
+    return input;
+}
 
+int exec_compile_dir_to_ram(const char* filename)
+{
+    Input* input = exec_input_from_dir(filename);
+    if (!input) {
+        return 1;
+    } else {
         Output* output = compile_input(input);
         input_free(input);
         const char* error = output_error_message(output);
@@ -5,4 +5,7 @@ int exec_compile_to_stdout(const char *filename);
 int exec_compile_file_to_ram(const char* filename);
 int exec_compile_dir_to_ram(const char* filename);
 
+typedef struct Input Input;
+Input* exec_input_from_dir(const char* dirname);     // all the files in a directory, NULL on error
+
 #endif //RETROLAB_EXEC_H
@@ -1,5 +1,8 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <getopt.h>
 #include <dirent.h>
 
@@ -7,11 +10,37 @@
 
 #include "global.h"
 #include "emulator/emulator.h"
+#include "emulator/framebuffer.h"
 #include "emulator/video.h"
 #include "emulator/cpu.h"
+#include "emulator/history.h"
+#include "emulator/memory.h"
+#include "emulator/profile.h"
+#include "emulator/recorder.h"
+#include "emulator/replay.h"
+#include "emulator/trace.h"
 
 #include "exec/exec.h"
 
+static const char* trace_file = NULL;
+static const char* profile_file = NULL;
+static const char* record_file = NULL;
+static const char* replay_file = NULL;
+static const char* video_file = NULL;
+static uint64_t    seed;
+static bool        headless = false;
+static uint64_t    run_cycles = 0;      // in headless mode
+
+#define MAX_FRAME_DUMPS 64
+
+typedef struct FrameDump {
+    uint64_t    frame;      // number of frames finished when it's saved
+    const char* filename;
+} FrameDump;
+
+static FrameDump   frame_dumps[MAX_FRAME_DUMPS];
+static size_t      n_frame_dumps = 0;
+
 static int
 main_loop()
 {
@@ -19,10 +48,21 @@ main_loop()
     emscripten_set_main_loop(emulator_step, 0, 1);
 #else
     while (video_running()) {
+        if (replay_playing()) {
+            // as fast as possible; when it's over, the program goes on as usual
+            if (replay_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_ERROR)
+                return cpu_error();
+            if (replay_finished())
+                replay_stop();
+            continue;
+        }
         unsigned int current_time = SDL_GetTicks();
-        CpuError cpu_error = emulator_frame();
-        if (cpu_error != CPU_ERROR_NO_ERROR)
-            return cpu_error;
+        if (history_enabled() && SDL_GetKeyboardState(NULL)[SDL_SCANCODE_F2]) {
+            history_back(1);    // while F2 is held, the program runs backwards
+            video_tick();
+        } else if (emulator_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_ERROR) {
+            return cpu_error();
+        }
         unsigned int new_time = SDL_GetTicks();
         long idle_time = (16L - (new_time - current_time));
         if (idle_time > 0)
@@ -32,6 +72,111 @@ main_loop()
 #endif
 }
 
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Saves the frame dumps (see --dump-frame) due after `frames` frames.
+static void
+dump_frames(uint64_t frames)
+{
+    for (size_t i = 0; i < n_frame_dumps; ++i)
+        if (frame_dumps[i].frame == frames && framebuffer_save(frame_dumps[i].filename) != 0)
+            perror(frame_dumps[i].filename);
+}
+
+// Runs without a window and as fast as possible: the number of cycles asked, or until the end of
+// the replay. Prints the speed and checksums of the final state, to compare runs.
+static int
+headless_loop()
+{
+    if (run_cycles == 0 && !replay_playing()) {
+        fprintf(stderr, "--headless needs --frames, --cycles or --replay.\n");
+        return 1;
+    }
+
+    uint64_t start = emulator_cycles();
+    uint64_t frames = 0;
+    double start_time = now();
+    dump_frames(frames);
+    for (;;) {
+        int cycles = STEPS_PER_FRAME;
+        if (run_cycles == 0) {
+            if (replay_finished())
+                break;
+        } else {
+            uint64_t left = run_cycles - (emulator_cycles() - start);
+            if (left == 0)
+                break;
+            if (left < (uint64_t) cycles)
+                cycles = (int) left;
+        }
+        EmulatorStop stop = replay_run_cycles(cycles, EMULATOR_STOP_END_OF_FRAME);
+        if (stop == EMULATOR_STOP_ERROR)
+            break;
+        if (stop == EMULATOR_STOP_END_OF_FRAME)
+            dump_frames(++frames);
+    }
+    double elapsed = now() - start_time;
+    uint64_t executed = emulator_cycles() - start;
+
+    uint64_t registers = 0xcbf29ce484222325;    // FNV-1a, as ram_hash
+    for (uint8_t i = 0; i < 16; ++i)
+        registers = (registers ^ cpu_register(i)) * 0x100000001b3;
+
+    printf("cycles     %llu\n", (unsigned long long) executed);
+    printf("frames     %.2f\n", (double) executed / STEPS_PER_FRAME);
+    printf("seconds    %.3f\n", elapsed);
+    printf("mhz        %.2f\n", (double) executed / elapsed / 1e6);
+    printf("fps        %.1f\n", (double) executed / STEPS_PER_FRAME / elapsed);
+    printf("registers  %016llx\n", (unsigned long long) registers);
+    printf("memory     %016llx\n", (unsigned long long) ram_hash());
+    printf("error      %d\n", cpu_error());
+    return cpu_error();
+}
+
+static int
+decode_trace(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return 1;
+    }
+    int r = trace_decode(f, stdout);
+    fclose(f);
+    if (r != 0) {
+        fprintf(stderr, "%s: not a valid trace file.\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+// Starts recording or playing the input, once the program is loaded.
+static bool
+start_replay()
+{
+    if (record_file) {
+        if (history_enabled() || replay_file) {
+            fprintf(stderr, "--record can't be used with --rewind or --replay.\n");
+            return false;
+        }
+        if (replay_record(record_file, seed) != 0) {
+            perror(record_file);
+            return false;
+        }
+    }
+    if (replay_file && replay_play(replay_file) != 0) {
+        fprintf(stderr, "%s: not a valid replay of this program.\n", replay_file);
+        return false;
+    }
+    return true;
+}
+
 static void
 show_help(const char* program_name)
 {
@@ -41,6 +186,22 @@ show_help(const char* program_name)
     printf("   -s, --source-file    Compile a source file and execute on the emulator\n");
     printf("   -d, --source-dir     Compile a project directory and execute on the emulator\n");
     printf("   -D, --debug          Show debugging information for each CPU step\n");
+    printf("   -S, --seed           Seed for CPU_RANDOM, to make runs reproducible\n");
+    printf("   -T, --trace          Keep a trace of the last CPU steps, and save it to a file on exit\n");
+    printf("   -t, --decode-trace   Disassemble a trace file to stdout\n");
+    printf("   -P, --profile        Save the execution histogram to a CSV (or .json) file on exit\n");
+    printf("   -R, --rewind         Keep the last 60 seconds, to run backwards while F2 is held\n");
+    printf("   -i, --record         Record the input to a file, to reproduce the run with --replay\n");
+    printf("   -p, --replay         Replay a recorded input file as fast as possible, then go on as usual\n");
+    printf("   -H, --headless       Run without a window and as fast as possible, then print the speed\n");
+    printf("                        and checksums of the final state (with --frames, --cycles or --replay)\n");
+    printf("   -f, --frames         Number of frames to run headless\n");
+    printf("   -n, --cycles         Number of cycles (CPU steps) to run headless\n");
+    printf("   -F, --dump-frame     Save the screen after N frames, as N:FILE (PNG, PPM, or text if FILE\n");
+    printf("                        ends in .txt), in headless mode. Can be used many times\n");
+    printf("   -V, --record-video   Record the screen to a video file: Y4M if it ends in .y4m, raw RGB24\n");
+    printf("                        frames of 260x290 otherwise\n");
+    printf("   -G, --draw-calls     Draw each character with SDL calls (the old, slower renderer)\n");
     printf("   -h, --help           Show this help\n");
     printf("   -v, --version        Show version and exit\n");
     printf("Visit <" HOMEPAGE "> for a richer experience developing for this emulator.\n\n");
@@ -51,6 +212,17 @@ static void show_version()
     printf("Retrolab emulator/compiler version " VERSION "\n");
 }
 
+// Whether to run headless has to be known before the emulator is initialized, as it decides if there
+// is a window.
+static bool
+is_headless(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--headless") == 0)
+            return true;
+    return false;
+}
+
 void
 parse_args(int argc, char* argv[])
 {
@@ -62,13 +234,26 @@ parse_args(int argc, char* argv[])
             { "source-file",  required_argument, 0, 's' },
             { "source-dir",   required_argument, 0, 'd' },
             { "debug",        no_argument,       0, 'D' },
+            { "seed",         required_argument, 0, 'S' },
+            { "trace",        required_argument, 0, 'T' },
+            { "decode-trace", required_argument, 0, 't' },
+            { "profile",      required_argument, 0, 'P' },
+            { "rewind",       no_argument,       0, 'R' },
+            { "record",       required_argument, 0, 'i' },
+            { "replay",       required_argument, 0, 'p' },
+            { "headless",     no_argument,       0, 'H' },
+            { "dump-frame",   required_argument, 0, 'F' },
+            { "record-video", required_argument, 0, 'V' },
+            { "draw-calls",   no_argument,       0, 'G' },
+            { "frames",       required_argument, 0, 'f' },
+            { "cycles",       required_argument, 0, 'n' },
             { "help",         no_argument,       0, 'h' },
             { "version",      no_argument,       0, 'v' },
             { 0, 0, 0, 0 },
         };
 
         int opt_idx;
-        c = getopt_long(argc, argv, "r:c:s:d:Dhv", long_options, &opt_idx);
+        c = getopt_long(argc, argv, "r:c:s:d:DS:T:t:P:Ri:p:HF:V:Gf:n:hv", long_options, &opt_idx);
         if (c == -1)
             break;
         switch (c) {
@@ -89,6 +274,56 @@ parse_args(int argc, char* argv[])
             case 'D':
                 cpu_set_debugging_mode(true);
                 break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                cpu_set_random_seed(seed);
+                break;
+            case 'T':
+                trace_file = optarg;
+                trace_start(TRACE_DEFAULT_SZ);
+                break;
+            case 't':
+                exit(decode_trace(optarg));
+            case 'P':
+                if (!profile_enabled()) {
+                    fprintf(stderr, "The execution histogram is not available: build with -DPROFILE=ON.\n");
+                    exit(1);
+                }
+                profile_file = optarg;
+                break;
+            case 'R':
+                history_start(HISTORY_DEFAULT_FRAMES, HISTORY_DEFAULT_BUDGET, HISTORY_KEYFRAME_INTERVAL);
+                break;
+            case 'i':
+                record_file = optarg;
+                break;
+            case 'p':
+                replay_file = optarg;
+                break;
+            case 'H':
+                break;      // see is_headless
+            case 'F': {
+                char* filename;
+                uint64_t frame = strtoull(optarg, &filename, 0);
+                if (*filename != ':' || n_frame_dumps == MAX_FRAME_DUMPS) {
+                    show_help(argv[0]);
+                    exit(1);
+                }
+                frame_dumps[n_frame_dumps++] = (FrameDump) { frame, filename + 1 };
+                break;
+            }
+            case 'V':
+                video_file = optarg;
+                break;
+            case 'G':
+                video_set_draw_calls(true);
+                break;
+            case 'f':
+                run_cycles = strtoull(optarg, NULL, 0) * STEPS_PER_FRAME;
+                break;
+            case 'n':
+                run_cycles = strtoull(optarg, NULL, 0);
+                break;
             case 'h':
                 show_help(argv[0]);
                 exit(0);
@@ -107,10 +342,31 @@ main(int argc, char* argv[])
 {
     int r = 0;
 #if !__EMSCRIPTEN__
+    headless = is_headless(argc, argv);
+    emulator_set_headless(headless);
     emulator_init(true);
+    seed = (uint64_t) time(NULL);
     parse_args(argc, argv);
-    r = main_loop();
-    video_destroy();
+    if (!start_replay())
+        return 1;
+    if (video_file && recorder_start(video_file, headless) != 0) {      // headless runs can wait for the disk
+        perror(video_file);
+        return 1;
+    }
+    r = headless ? headless_loop() : main_loop();
+    if (trace_file && trace_dump_file(trace_file) != 0)
+        perror(trace_file);
+    if (profile_file && profile_dump_file(profile_file) != 0)
+        perror(profile_file);
+    if (video_file) {
+        if (recorder_stop() != 0)
+            perror(video_file);
+        else if (recorder_dropped() > 0)
+            fprintf(stderr, "%s: %llu frames dropped, the disk was too slow.\n", video_file,
+                    (unsigned long long) recorder_dropped());
+    }
+    if (!headless)
+        video_destroy();
     emulator_destroy();
 #else
     (void) argc;
@@ -7,8 +7,18 @@
 #include "emulator/breakpoints.h"
 #include "emulator/cpu.h"
 #include "emulator/emulator.h"
+#include "emulator/framebuffer.h"
+#include "emulator/recorder.h"
+#include "emulator/history.h"
+#include "emulator/machine.h"
 #include "emulator/memory.h"
+#include "emulator/profile.h"
+#include "emulator/replay.h"
+#include "emulator/scheduler.h"
+#include "emulator/snapshot.h"
+#include "emulator/trace.h"
 #include "exec/exec.h"
+#include "mmap.h"
 
 extern const char* retrolab_def;
 
@@ -923,6 +933,10 @@ static int if_skip()   // test if false ifs are skipped in a single CPU step
     return 0;
 }
 
+ASSERT_EXEC(if_skip_invalid, "ifeq A, 1\n"
+                             "db   0x02, 0x85, 0x00\n"     // MOV with an invalid operand, never decoded
+                             "mov  B, 1",  cpu_B() == 1)
+
 static int skips()
 {
     printf("Skips:\n");
@@ -933,6 +947,7 @@ static int skips()
     verify(ifgt);
     verify(ifgt_signed);
     verify(if_skip);
+    verify(if_skip_invalid);
     printf("\n");
     return 0;
 }
@@ -1075,6 +1090,43 @@ static int wait()
     return 0;
 }
 
+static int queue()
+{
+    emulator_init(true);
+    Output* output = compile_string("        ivec 0x18, .interrupt\n"
+                                    "        mov  B, 0x1000\n"
+                                    ".loop:  jmp  .loop\n"
+                                    ".interrupt:\n"
+                                    "        mov  ^[B], XT\n"
+                                    "        add  B, 2\n"
+                                    "        iret");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    cpu_step();
+    cpu_step();
+
+    // more interrupts than the queue can hold
+    for (int i = 0; i < 300; ++i)
+        cpu_interrupt(0x18, i);
+    _assert(cpu_interrupt_overflows() == 300 - INTERRUPT_QUEUE_SZ);
+    for (int i = 0; i < 2000; ++i)
+        cpu_step();
+    _assert(cpu_B() == 0x1000 + 2 * INTERRUPT_QUEUE_SZ);
+    for (int i = 0; i < INTERRUPT_QUEUE_SZ; ++i)
+        _assert(ram_get16(0x1000 + 2 * i) == i);
+
+    // the queue wraps around
+    for (int i = 0; i < 10; ++i)
+        cpu_interrupt(0x18, 1000 + i);
+    for (int i = 0; i < 100; ++i)
+        cpu_step();
+    for (int i = 0; i < 10; ++i)
+        _assert(ram_get16(0x1000 + 2 * (INTERRUPT_QUEUE_SZ + i)) == 1000 + i);
+
+    emulator_destroy();
+    return 0;
+}
+
 static int interrupts()
 {
     printf("Interrupts:\n");
@@ -1082,6 +1134,7 @@ static int interrupts()
     verify(ivec_int);
     verify(ienab);
     verify(wait);
+    verify(queue);
     printf("\n");
     return 0;
 }
@@ -1106,16 +1159,516 @@ ASSERT_EXEC(_memset, "mov  X, 0x10\n"
                      "dev  DEV_MEM_MGR, MEM_SET",
                      ram[0x10] == 'x' && ram[0x11] == 'x' && ram[0x12] == 'x' && ram[0x14] != 'x')
 
+ASSERT_EXEC(_memset_end, "mov  X, 0xfff0\n"      // stops at the end of the memory
+                         "mov  Y, 0x100\n"
+                         "mov  F, 7\n"
+                         "dev  DEV_MEM_MGR, MEM_SET",
+                         ram[0xfff0] == 7 && ram[0xffff] == 7 && ram[0x0] != 7)
+
+ASSERT_EXEC(_memset16, "mov  X, 0x100\n"
+                       "mov  Y, 4\n"
+                       "mov  F, 0x1234\n"
+                       "dev  DEV_MEM_MGR, MEM_SET16\n"
+                       "mov  Y, 8\n"
+                       "dev  DEV_MEM_MGR, MEM_CRC",
+                       ram[0x100] == 0x34 && ram[0x101] == 0x12 && ram[0x107] == 0x12 && ram[0x108] == 0
+                       && cpu_Y() == 0x76da)
+
+ASSERT_EXEC(_memcmp, "mov  X, 0x100\n"
+                     "mov  F, 0x110\n"
+                     "mov  [0x10b], 1\n"
+                     "mov  Y, 0x10\n"
+                     "dev  DEV_MEM_MGR, MEM_CMP\n"
+                     "mov  A, Y\n"
+                     "mov  Y, 0x0b\n"
+                     "dev  DEV_MEM_MGR, MEM_CMP",
+                     cpu_A() == 0x0b && cpu_Y() == 0x0b)
+
+ASSERT_EXEC(_memfind, "mov  X, 0x100\n"
+                      "mov  [0x107], 'x'\n"
+                      "mov  Y, 0x10\n"
+                      "mov  F, 'x'\n"
+                      "dev  DEV_MEM_MGR, MEM_FIND\n"
+                      "mov  A, Y\n"
+                      "mov  Y, 0x10\n"
+                      "mov  F, 'y'\n"
+                      "dev  DEV_MEM_MGR, MEM_FIND",
+                      cpu_A() == 7 && cpu_Y() == 0x10)
+
+// device commands keep the CPU busy for a number of steps that depends on their size
+static int _memory_manager_steps()
+{
+    emulator_init(true);
+    Output* output = compile_string("mov  X, 0x1000\n"
+                                    "mov  Y, 0x100\n"
+                                    "mov  F, 0x2000\n"
+                                    "dev  DEV_MEM_MGR, MEM_CPY\n"
+                                    "inc  A\n"
+                                    ".loop: jmp .loop");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    ram_set(0x10ff, 42);
+
+    _assert(cpu_run(4) == 4 && ram[0x20ff] == 42);
+    reg_t pc = cpu_PC();
+    _assert(cpu_run(16) == 16 && cpu_PC() == pc && cpu_A() == 0);      // 0x100 bytes, 16 per step
+    _assert(cpu_run(1) == 1 && cpu_A() == 1);
+    emulator_destroy();
+    return 0;
+}
+
 ASSERT_EXEC(_random, "mov A, [CPU_RANDOM]\n"
                      "mov B, [CPU_RANDOM]\n"
                      "mov C, [CPU_RANDOM]", cpu_A() != cpu_B() && cpu_B() != cpu_C())
 
+ASSERT_EXEC(_random_block, "mov  X, CPU_RANDOM\n"      // block reads get a new number too
+                           "mov  Y, 2\n"
+                           "mov  F, 0x100\n"
+                           "dev  DEV_MEM_MGR, MEM_CPY\n"
+                           "mov  F, 0x102\n"
+                           "dev  DEV_MEM_MGR, MEM_CPY",
+                           ram_get16(0x100) != ram_get16(0x102))
+
+static void
+run_random(uint64_t seed, const char* code, reg_t* regs)
+{
+    emulator_init(true);
+    cpu_set_random_seed(seed);
+    Output* output = compile_string(code);
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    for (int i = 0; i < 10; ++i)
+        cpu_step();
+    for (uint8_t i = 0; i < 3; ++i)
+        regs[i] = cpu_register(i);
+    regs[3] = ram_get16(CPU_RANDOM);
+    emulator_destroy();
+}
+
+static int _random_seed()
+{
+    const char* code = "mov A, [CPU_RANDOM]\n"
+                       "mov B, ^[CPU_RANDOM - 1]\n"
+                       "ifne A, A\n"
+                       "mov B, [CPU_RANDOM]\n"    // skipped: doesn't generate a number
+                       "mov C, ^[CPU_RANDOM]";
+    reg_t r1[4], r2[4], r3[4], r4[4];
+    run_random(42, code, r1);
+    run_random(42, code, r2);
+    run_random(43, code, r3);
+    run_random(42, "mov A, [CPU_RANDOM]\nmov B, ^[CPU_RANDOM - 1]\nmov C, ^[CPU_RANDOM]", r4);
+    _assert(memcmp(r1, r2, sizeof r1) == 0);
+    _assert(memcmp(r1, r3, sizeof r1) != 0);
+    _assert(memcmp(r1, r4, sizeof r1) == 0);
+    _assert(r1[3] == r1[2]);    // not regenerated by instructions that don't read it
+    return 0;
+}
+
 static int external()
 {
     printf("External:\n");
     verify(_memcpy);
     verify(_memset);
+    verify(_memset_end);
+    verify(_memset16);
+    verify(_memcmp);
+    verify(_memfind);
+    verify(_memory_manager_steps);
     verify(_random);
+    verify(_random_block);
+    verify(_random_seed);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ decoding
+
+ASSERT_EXEC(self_modifying, "        mov  B, 0\n"
+                            ".again: mov  A, 5\n"
+                            "        ifne B, 0\n"
+                            "        jmp  .done\n"
+                            "        mov  [.again + 2], 7\n"
+                            "        mov  B, 1\n"
+                            "        jmp  .again\n"
+                            ".done:", cpu_A() == 7)
+
+static int reload_code()
+{
+    emulator_init(true);
+    Output* output = compile_string("mov A, 1\njmp 0");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    cpu_step();
+    cpu_step();
+    _assert(cpu_A() == 1 && cpu_PC() == 0);
+
+    output = compile_string("mov A, 2");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    cpu_step();
+    _assert(cpu_A() == 2);
+
+    emulator_destroy();
+    return 0;
+}
+
+static int decoding()
+{
+    printf("Decoding:\n");
+    verify(self_modifying);
+    verify(reload_code);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ dispatch engines
+
+// Runs a program for a few thousand steps, either one step at a time (chunk == 0) or through
+// cpu_run in chunks of `chunk` steps, raising interrupt 0x18 every 100 steps.
+static void
+run_engine(const char* code, int chunk, uint8_t* mem, reg_t* regs)
+{
+    emulator_init(true);
+    Output* output = compile_string(code);
+    _assert(output_error_message(output) == NULL);
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    cpu_set_random_seed(1);
+
+    for (int n = 0; n < 3000; n += 100) {
+        cpu_interrupt(0x18, n);
+        if (chunk == 0) {
+            for (int i = 0; i < 100; ++i)
+                cpu_step();
+        } else {
+            for (int i = 0; i < 100; )
+                i += cpu_run(100 - i < chunk ? 100 - i : chunk);
+        }
+    }
+
+    memcpy(mem, ram, 0x10000);
+    for (uint8_t i = 0; i < 16; ++i)
+        regs[i] = cpu_register(i);
+    emulator_destroy();
+}
+
+static bool
+engines_agree(const char* code)
+{
+    static uint8_t mem[2][0x10000];
+    reg_t regs[2][16];
+
+    run_engine(code, 0, mem[0], regs[0]);
+    int chunks[] = { 1, 7, 100 };
+    for (size_t i = 0; i < sizeof chunks / sizeof chunks[0]; ++i) {
+        run_engine(code, chunks[i], mem[1], regs[1]);
+        if (memcmp(mem[0], mem[1], 0x10000) != 0 || memcmp(regs[0], regs[1], sizeof regs[0]) != 0)
+            return false;
+    }
+    return true;
+}
+
+static int engines_loop()
+{
+    _assert(engines_agree("        mov  I, 0\n"
+                          "        mov  B, 0x1000\n"
+                          ".loop:  jsr  .sub\n"
+                          "        inc  I\n"
+                          "        iflt I, 50\n"
+                          "        jmp  .loop\n"
+                          "        pusha\n"
+                          "        mov  A, [CPU_RANDOM]\n"
+                          "        and  A, 1\n"
+                          "        mul  A, .sub2 - .sub\n"
+                          "        add  A, .sub\n"
+                          "        mov  ^[.loop + 2], A\n"    // self-modifying: rewrite the jsr target
+                          "        popa\n"
+                          "        mov  I, 0\n"
+                          "        jmp  .loop\n"
+                          ".sub:   pushw I\n"
+                          "        add  [B], ^[CPU_RANDOM]\n"
+                          "        ifgt$ I, -1\n"
+                          "        shl  [B], 1\n"
+                          "        inc  B\n"
+                          "        popw J\n"
+                          "        ret\n"
+                          ".sub2:  add  [B], 3\n"
+                          "        inc  B\n"
+                          "        ret"));
+    return 0;
+}
+
+static int engines_interrupts()
+{
+    _assert(engines_agree("        ivec 0x18, .interrupt\n"
+                          "        ivec INT_CPU, .cpu\n"
+                          ".loop:  inc  A\n"
+                          "        ifeq A, 30\n"
+                          "        wait\n"
+                          "        div  B, [CPU_RANDOM]\n"
+                          "        jmp  .loop\n"
+                          ".interrupt:\n"
+                          "        mov  A, XT\n"
+                          "        div  C, 0\n"
+                          "        iret\n"
+                          ".cpu:   inc  D\n"
+                          "        iret"));
+    return 0;
+}
+
+static int engines_devices()
+{
+    _assert(engines_agree("        mov  X, 0x1000\n"
+                          "        mov  Y, 0x20\n"
+                          ".loop:  inc  F\n"
+                          "        dev  DEV_MEM_MGR, MEM_SET\n"
+                          "        add  X, 0x10\n"
+                          "        ifne F, 0x40\n"
+                          "        jmp  .loop\n"
+                          "        ifeq A, 1\n"
+                          "        db   0x03\n"             // skipped invalid opcode
+                          "        mov  A, 1\n"
+                          "        dbg\n"
+                          "        db   0x03"));             // invalid opcode
+    return 0;
+}
+
+static int engines_alu()
+{
+    _assert(engines_agree("        mov  A, 0x1234\n"
+                          "        mov  B, 0xfff0\n"
+                          ".loop:  add  A, 0x4321\n"
+                          "        mul  A, B\n"
+                          "        add  Y, OV\n"
+                          "        shl  A, C\n"
+                          "        shr  B, 1\n"
+                          "        xor  B, A\n"
+                          "        not  E\n"
+                          "        inc  C\n"
+                          "        mov  ^[D + 0x2000], A\n"
+                          "        or   [D + 0x3000], B\n"
+                          "        sub  E, ^[D + 0x1fff]\n"
+                          "        mov  X, OV\n"
+                          "        xor  Y, X\n"
+                          "        mov  F, CPU_RANDOM - 1\n"
+                          "        add  I, ^[F]\n"          // reads CPU_RANDOM through a register
+                          "        add  K, [F + 2]\n"
+                          "        mov  J, ^[0xffff]\n"     // wraps around
+                          "        add  [0xffff], 1\n"
+                          "        dec  D\n"
+                          "        ifgt$ D, -30\n"
+                          "        jmp  .loop\n"
+                          "        iflt A, B\n"
+                          "        mov  D, 0\n"
+                          "        jmp  .loop"));
+    return 0;
+}
+
+static int engines_self_modifying()
+{
+    _assert(engines_agree(".top:   mov  [.patch + 3], K\n"   // patches the instruction below, in the same block
+                          "        inc  K\n"
+                          ".patch: mov  A, 0x1234\n"
+                          "        add  B, A\n"
+                          "        jmp  .top"));
+    return 0;
+}
+
+static int engines_fused()
+{
+    _assert(engines_agree("        mov  SP, 0x8000\n"
+                          ".loop:  mov  A, I\n"              // MOV + ALU on the same register
+                          "        mul  A, 3\n"
+                          "        mov  B, A\n"
+                          "        add  B, [CPU_RANDOM]\n"
+                          "        pushw A\n"                // PUSHW / POPW runs
+                          "        pushw B\n"
+                          "        popw C\n"
+                          "        popw D\n"
+                          "        pushw I\n"
+                          "        popw ^[SP + 4]\n"          // the operand depends on the SP left by the PUSHW
+                          "        mov  PC, .next\n"          // not fused: a jump
+                          ".next:  inc  I\n"
+                          "        ifeq I, 20\n"
+                          "        mov  I, 0\n"
+                          "        iflt I, 10\n"             // IFxx + JMP
+                          "        jmp  .loop\n"
+                          "        ifge I, 10\n"             // skipped fused pair
+                          "        pushw I\n"
+                          "        popw E\n"
+                          "        mov  SP, .patch + 1\n"     // the PUSHW overwrites the instruction after it...
+                          "        pushw 0x952b\n"
+                          ".patch: popw F\n"             // ...with dec F
+                          "        nop\n"
+                          "        mov  SP, 0x8000\n"
+                          "        mov  [.patch], 0x53\n"
+                          "        mov  [.patch + 1], 0x95\n"
+                          "        jmp  .loop"));
+
+    // the pairs above are fused when the engine supports it
+    emulator_init(true);
+    Output* output = compile_string(".loop: iflt A, 10\n"
+                                    "       jmp .next\n"
+                                    "       mov A, 0\n"
+                                    ".next: mov B, A\n"
+                                    "       inc B\n"
+                                    "       pushw B\n"
+                                    "       popw A\n"
+                                    "       jmp .loop");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    uint64_t fused = cpu_fused_steps();
+    _assert(cpu_run(1000) == 1000);
+    fused = cpu_fused_steps() - fused;
+#if THREADED_DISPATCH && !JIT && !PROFILE     // the JIT runs instead of the threaded engine
+    _assert(fused > 0);
+#else
+    _assert(fused == 0);
+#endif
+    emulator_destroy();
+    return 0;
+}
+
+static int engines_idle()
+{
+    _assert(engines_agree("        ivec 0x18, .interrupt\n"
+                          "        mov  B, 3\n"
+                          ".halt:  jmp  .halt\n"
+                          ".wait:  wait\n"
+                          "        jmp  .wait\n"
+                          ".interrupt:\n"
+                          "        inc  A\n"
+                          "        ifeq A, 10\n"             // after 10 interrupts, wait instead of spinning
+                          "        mov  [.halt + 1], .wait\n"
+                          "        iret"));
+
+    // idle steps are not executed
+    emulator_init(true);
+    Output* output = compile_string("mov A, 1\n.halt: jmp .halt");
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+    _assert(cpu_run(1000000000) == 1000000000);
+    _assert(cpu_A() == 1 && cpu_PC() == 3);
+    _assert(cpu_idle_steps() >= 1000000000 - 3);    // the mov, and the jump once or twice
+    emulator_destroy();
+    return 0;
+}
+
+static int engines()
+{
+    printf("Dispatch engines:\n");
+    verify(engines_loop);
+    verify(engines_interrupts);
+    verify(engines_devices);
+    verify(engines_alu);
+    verify(engines_self_modifying);
+    verify(engines_fused);
+    verify(engines_idle);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ machines
+
+static void
+machine_compile(RetrolabMachine* m, const char* code)
+{
+    Output* output = compile_string(code);
+    _assert(output_error_message(output) == NULL);
+    machine_load(m, 0x0, output_binary_data(output), output_binary_size(output));
+    output_free(output);
+}
+
+static int machines_independent()
+{
+    emulator_init(true);
+    RetrolabMachine* m = machine_new();
+    _assert(m != NULL);
+    _assert(machine_current() == machine_default());
+
+    machine_compile(machine_default(), "mov A, 0x12\nmov [0x1000], A");
+    machine_compile(m, "mov A, 0x34\nmov [0x1000], 0x56");
+
+    machine_step(m);
+    _assert(machine_register(m, 0) == 0x34);
+    _assert(cpu_register(0) == 0);    // default machine untouched
+    cpu_step();
+    _assert(cpu_register(0) == 0x12);
+    _assert(machine_register(m, 0) == 0x34);
+
+    machine_step(m);
+    cpu_step();
+    _assert(ram[0x1000] == 0x12);
+    _assert(machine_ram(m)[0x1000] == 0x56);
+
+    machine_free(m);
+    emulator_destroy();
+    return 0;
+}
+
+static int machines_select()
+{
+    emulator_init(true);
+    RetrolabMachine* m = machine_new();
+    machine_compile(m, "mov B, 0x78");
+
+    RetrolabMachine* previous = machine_select(m);
+    _assert(previous == machine_default());
+    _assert(machine_current() == m);
+    cpu_step();
+    _assert(cpu_register(1) == 0x78);
+    machine_select(previous);
+
+    _assert(cpu_register(1) == 0);
+    _assert(machine_register(m, 1) == 0x78);
+
+    machine_free(m);
+    emulator_destroy();
+    return 0;
+}
+
+static int machines_frames()
+{
+    const char* code = "        ivec 0x18, .int\n"
+                       ".loop:  inc  [0x1000]\n"
+                       "        jmp  .loop\n"
+                       ".int:   inc  K\n"
+                       "        iret";
+
+    RetrolabMachine* m[2] = { machine_new(), machine_new() };
+    for (int i = 0; i < 2; ++i) {
+        machine_compile(m[i], code);
+        machine_frame(m[i]);    // set up the interrupt vector
+    }
+
+    for (int frame = 0; frame < 5; ++frame) {
+        machine_interrupt(m[0], 0x18, 0);
+        for (int i = 0; i < 2; ++i)
+            _assert(machine_frame(m[i]) == CPU_ERROR_NO_ERROR);
+    }
+
+    _assert(machine_register(m[0], 8) == 5);
+    _assert(machine_register(m[1], 8) == 0);
+    _assert(machine_ram(m[0])[0x1000] != 0);
+    _assert(machine_error(m[0]) == CPU_ERROR_NO_ERROR);
+
+    for (int i = 0; i < 2; ++i)
+        machine_free(m[i]);
+    return 0;
+}
+
+static int machines()
+{
+    printf("Machines:\n");
+    verify(machines_independent);
+    verify(machines_select);
+    verify(machines_frames);
     printf("\n");
     return 0;
 }
@@ -1200,11 +1753,966 @@ static int bkp_other_file()
     return 0;
 }
 
+static int bkp_many()
+{
+    emulator_init(true);
+    char code[2000] = "";
+    for (int i = 0; i < 200; ++i)
+        strcat(code, "inc A\n");
+    Output* output = compile_string(code);
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    cpu_load_debugging_info(output_debugging_info(output));
+
+    for (size_t line = 1; line <= 200; line += 2)
+        _assert(bkps_swap("main.s", line) == 1);
+    for (long addr = 0; addr < 400; addr += 2)
+        _assert(bkps_is_addr(addr) == (addr % 4 == 0));
+    _assert(bkps_swap("main.s", 51) == -1);
+    _assert(!bkps_is_addr(100));
+    _assert(bkps_is_addr(96) && bkps_is_addr(104));
+
+    bkps_clear();
+    for (long addr = 0; addr < 400; ++addr)
+        _assert(!bkps_is_addr(addr));
+    _assert(!bkps_is_addr(-1) && !bkps_is_addr(0x10000));
+
+    output_free(output);
+    emulator_destroy();
+    return 0;
+}
+
 static int breakpoints()
 {
     printf("Breakpoints:\n");
     verify(bkp);
     verify(bkp_other_file);
+    verify(bkp_many);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ running cycles
+
+static void
+load_program(const char* code)
+{
+    emulator_init(true);
+    Output* output = compile_string(code);
+    _assert(output_error_message(output) == NULL);
+    ram_load(0x0, output_binary_data(output), output_binary_size(output));
+    cpu_load_debugging_info(output_debugging_info(output));
+    output_free(output);
+}
+
+static int listener_calls = 0;
+static void listener() { ++listener_calls; }
+
+static int run_end_of_frame()
+{
+    load_program(".loop: inc A\njmp .loop");
+    _assert(emulator_run_cycles(STEPS_PER_FRAME / 2, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_NONE);
+    _assert(emulator_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_END_OF_FRAME);
+    _assert(cpu_A() == STEPS_PER_FRAME / 2);    // stopped in the end of the first frame
+    _assert(emulator_run_cycles(STEPS_PER_FRAME * 3, 0) == EMULATOR_STOP_NONE);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_breakpoint()
+{
+    load_program(".loop: nop\n"
+                 "       inc A\n"
+                 "       jmp .loop");
+    listener_calls = 0;
+    emulator_bkp_hit_set_fptr(listener);
+    _assert(bkps_swap("main.s", 2) == 1);
+
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 1 && cpu_A() == 0 && listener_calls == 1);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 1 && cpu_A() == 1 && listener_calls == 2);
+
+    // breakpoints not in the mask, or removed, are not checked
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_NONE);
+    _assert(bkps_swap("main.s", 2) == -1);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_NONE);
+    _assert(listener_calls == 2);
+
+    emulator_bkp_hit_set_fptr(NULL);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_watchpoint()
+{
+    load_program("       mov B, 0x1234\n"
+                 ".loop: inc A\n"
+                 "       mov [0x2000], A\n"       // watched
+                 "       mov [0x2000], A\n"       // same value again
+                 "       mov ^[0x3000], B\n"      // unwatched page
+                 "       add C, [0x2001]\n"       // read
+                 "       jmp .loop");
+    listener_calls = 0;
+    emulator_bkp_hit_set_fptr(listener);
+    _assert(bkps_watch_add(0x2000, 0x2001, WATCH_CHANGE) == 0);
+    _assert(bkps_watch_add(0x2001, 0x1fff, WATCH_WRITE) == -1);
+
+    // stops right after the instruction that changed the value, only once per loop
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 12 && cpu_A() == 1 && listener_calls == 1);
+    const WatchHit* hit = bkps_watch_last_hit();
+    _assert(hit && hit->addr == 0x2000 && hit->kind == WATCH_CHANGE && hit->old_value == 0 && hit->new_value == 1);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 12 && cpu_A() == 2 && listener_calls == 2);
+
+    // writes and reads
+    _assert(bkps_watch_remove(0x2000, 0x2001) && !bkps_watch_remove(0x2000, 0x2001));
+    _assert(bkps_watch_add(0x2000, 0x2000, WATCH_WRITE) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 17 && listener_calls == 3);
+    _assert(bkps_watch_remove(0x2000, 0x2000) && bkps_watch_add(0x2001, 0x2001, WATCH_READ) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(cpu_PC() == 27 && listener_calls == 4);
+    hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x2001 && hit->kind == WATCH_READ);
+
+    static char json[10000];
+    emulator_dbg_json(0, json, sizeof json);
+    _assert(strstr(json, "\"watchpoints\":[{\"start\":8193,\"end\":8193,\"read\":true,\"write\":false,\"change\":false}]"));
+    _assert(strstr(json, "\"watchHit\":{\"addr\":8193,\"kind\":\"read\",\"old\":0,\"new\":0}"));
+
+    // nothing stops once they're gone
+    bkps_clear();
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_NONE);
+    _assert(listener_calls == 4 && bkps_watch_last_hit() == NULL);
+
+    emulator_bkp_hit_set_fptr(NULL);
+    emulator_destroy();
+    return 0;
+}
+
+// the memory manager reads and writes whole blocks, which the watchpoints see too
+static int run_watchpoint_blocks()
+{
+    load_program(".loop: mov  X, 0x2000\n"
+                 "       mov  Y, 0x300\n"        // three pages
+                 "       mov  F, 7\n"
+                 "       dev  DEV_MEM_MGR, MEM_SET\n"
+                 "       mov  F, 0x4000\n"
+                 "       dev  DEV_MEM_MGR, MEM_CPY\n"
+                 "       jmp  .loop");
+    emulator_bkp_hit_set_fptr(listener);
+    _assert(bkps_watch_add(0x2250, 0x2250, WATCH_CHANGE) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    const WatchHit* hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x2250 && hit->kind == WATCH_CHANGE && hit->old_value == 0 && hit->new_value == 7);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_NONE);    // same value
+
+    _assert(bkps_watch_add(0x2150, 0x2150, WATCH_READ) == 0);      // source of the copy
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x2150 && hit->kind == WATCH_READ && hit->old_value == 7);
+
+    _assert(bkps_watch_remove(0x2150, 0x2150) && bkps_watch_add(0x4123, 0x4123, WATCH_WRITE) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x4123 && hit->kind == WATCH_WRITE && hit->new_value == 7);
+
+    bkps_clear();
+    emulator_bkp_hit_set_fptr(NULL);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_watchpoint_block_reads()
+{
+    load_program("       mov  X, 0x2000\n"
+                 "       mov  Y, 0x100\n"
+                 "       mov  F, 0x1234\n"
+                 "       dev  DEV_MEM_MGR, MEM_SET16\n"
+                 ".loop: mov  X, 0x2000\n"
+                 "       mov  Y, 0x200\n"
+                 "       dev  DEV_MEM_MGR, MEM_CRC\n"
+                 "       mov  Y, 0x200\n"
+                 "       mov  F, 0x3000\n"
+                 "       dev  DEV_MEM_MGR, MEM_CMP\n"       // differs right away
+                 "       mov  X, 0x4000\n"
+                 "       mov  Y, 0x200\n"
+                 "       mov  F, 1\n"
+                 "       dev  DEV_MEM_MGR, MEM_FIND\n"      // not found
+                 "       jmp  .loop");
+    emulator_bkp_hit_set_fptr(listener);
+    _assert(bkps_watch_add(0x2101, 0x2101, WATCH_CHANGE) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    const WatchHit* hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x2101 && hit->kind == WATCH_CHANGE && hit->old_value == 0 && hit->new_value == 0x12);
+
+    _assert(bkps_watch_add(0x21ff, 0x21ff, WATCH_READ) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    hit = bkps_watch_last_hit();
+    _assert(hit->addr == 0x21ff && hit->kind == WATCH_READ && hit->old_value == 0x12);
+
+    // only the bytes compared are read
+    _assert(bkps_watch_remove(0x21ff, 0x21ff) && bkps_watch_add(0x3100, 0x3100, WATCH_READ) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_NONE);
+    _assert(bkps_watch_add(0x3000, 0x3000, WATCH_READ) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(bkps_watch_last_hit()->addr == 0x3000);
+
+    _assert(bkps_watch_remove(0x3000, 0x3000) && bkps_watch_add(0x41ff, 0x41ff, WATCH_READ) == 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_BREAKPOINT) == EMULATOR_STOP_BREAKPOINT);
+    _assert(bkps_watch_last_hit()->addr == 0x41ff);
+
+    bkps_clear();
+    emulator_bkp_hit_set_fptr(NULL);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_wait()
+{
+    load_program("ivec 0x18, .interrupt\n"
+                 ".loop: wait\n"
+                 "       jmp .loop\n"
+                 ".interrupt:\n"
+                 "       inc A\n"
+                 "       iret");
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_WAIT) == EMULATOR_STOP_WAIT);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_WAIT) == EMULATOR_STOP_WAIT);   // still waiting
+    cpu_interrupt(0x18, 0);
+    _assert(emulator_run_cycles(1000, EMULATOR_STOP_WAIT) == EMULATOR_STOP_WAIT);
+    _assert(cpu_A() == 1);
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_NONE);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_scheduler()
+{
+    RetrolabMachine* m = machine_new();
+    RetrolabMachine* previous = machine_select(m);
+
+    // events in the same cycle run in the order of their kind
+    _assert(scheduler_next() == STEPS_PER_FRAME);
+    scheduler_add(SCHED_TIMERS, 100);
+    scheduler_add(SCHED_END_OF_FRAME, 100);
+    _assert(scheduler_when(SCHED_TIMERS) == 100 && scheduler_next() == 100);
+    _assert(scheduler_pop_due() == -1);
+    scheduler_advance(100);
+    _assert(scheduler_pop_due() == SCHED_END_OF_FRAME);
+    _assert(scheduler_pop_due() == SCHED_TIMERS);
+    _assert(scheduler_pop_due() == -1 && scheduler_next() == SCHEDULER_NEVER);
+
+    scheduler_add(SCHED_END_OF_FRAME, 300);
+    scheduler_add(SCHED_TIMERS, 200);
+    scheduler_add(SCHED_TIMERS, 400);       // replaces the previous one
+    _assert(scheduler_next() == 300);
+    scheduler_remove(SCHED_END_OF_FRAME);
+    _assert(scheduler_next() == 400 && scheduler_when(SCHED_END_OF_FRAME) == SCHEDULER_NEVER);
+
+    machine_select(previous);
+    machine_free(m);
+    return 0;
+}
+
+static int run_frame_timer()
+{
+    load_program("        ivec INT_TIMER, .timer\n"
+                 "        mov ^[TIMER_FRAME_0], 2\n"
+                 ".loop:  wait\n"
+                 "        jmp .loop\n"
+                 ".timer: inc A\n"
+                 "        iret");
+    emulator_set_frame_position(0);
+    uint64_t start = emulator_cycles();
+    _assert(emulator_run_cycles(100, 0) == EMULATOR_STOP_NONE);
+    _assert(emulator_frame_position() == 100 && emulator_cycles() - start == 100);
+
+    // the CPU is waiting, so it skips from one frame to the next
+    _assert(emulator_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_END_OF_FRAME);
+    _assert(emulator_frame_position() == 0 && cpu_A() == 0);
+    _assert(emulator_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME) == EMULATOR_STOP_END_OF_FRAME);
+    _assert(emulator_cycles() - start == 2 * STEPS_PER_FRAME);
+    _assert(emulator_run_cycles(100, 0) == EMULATOR_STOP_NONE);
+    _assert(cpu_A() == 1);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_error()
+{
+    load_program("nop\ndb 0xfe");
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_ERROR);
+    _assert(cpu_error() == CPU_ERROR_INVALID_OPCODE);
+    emulator_destroy();
+    return 0;
+}
+
+static int run_cycles()
+{
+    printf("Running cycles:\n");
+    verify(run_end_of_frame);
+    verify(run_breakpoint);
+    verify(run_watchpoint);
+    verify(run_watchpoint_blocks);
+    verify(run_watchpoint_block_reads);
+    verify(run_wait);
+    verify(run_scheduler);
+    verify(run_frame_timer);
+    verify(run_error);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ tracing
+
+static int trace_steps()
+{
+    load_program("       mov A, 5\n"
+                 "       ifeq A, 6\n"
+                 "       mov B, 1\n"
+                 "       inc C\n"
+                 ".loop: jmp .loop");
+    trace_start(16);
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_NONE);
+
+    TraceRecord t[16];
+    _assert(trace_records(t, 16) == 5);
+    _assert(t[0].pc == 0 && t[0].bytes[0] == 0x2 && t[0].changed == (1 << 0) && t[0].values[0] == 5);
+    _assert(t[1].bytes[0] == 0x31 && t[1].changed == 0 && t[1].flags == 0);
+    _assert(t[2].bytes[0] == 0x2 && t[2].changed == 0 && t[2].flags == TRACE_SKIPPED);
+    _assert(t[3].bytes[0] == 0x2a && t[3].changed == (1 << 2) && t[3].values[0] == 1);
+    _assert(t[0].cycle == 0 && t[1].cycle == 1 && t[2].cycle == 1 && t[3].cycle == 2 && t[4].cycle == 3);
+
+    // the CPU is idle in the jump: the remaining steps are not executed, but they are counted
+    emulator_step();
+    _assert(trace_records(t, 16) == 6);
+    _assert(t[5].pc == t[4].pc && t[5].cycle == 1000);
+
+    emulator_destroy();
+    return 0;
+}
+
+static int trace_ring()
+{
+    load_program(".loop: inc A\n"
+                 "       inc B\n"
+                 "       jmp .loop");
+    trace_start(4);
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_NONE);
+    TraceRecord t[16];
+    _assert(trace_records(t, 16) == 4);
+    _assert(t[3].cycle == 999);
+    for (int i = 1; i < 4; ++i)
+        _assert(t[i].cycle == t[i - 1].cycle + 1);
+    emulator_destroy();
+    _assert(!trace_enabled());
+    return 0;
+}
+
+static int trace_decoding()
+{
+    load_program("       mov A, 5\n"
+                 "       ifeq A, 6\n"
+                 "       mov ^[B + 0x1234], [0x20]\n"
+                 "       db 0xfe");
+    trace_start(TRACE_DEFAULT_SZ);
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_ERROR);
+
+    FILE* dump = tmpfile();
+    _assert(trace_dump(dump) == 0);
+    rewind(dump);
+    FILE* text = tmpfile();
+    _assert(trace_decode(dump, text) == 0);
+    rewind(text);
+
+    char buf[2048] = { 0 };
+    fread(buf, 1, sizeof buf - 1, text);
+    fclose(dump);
+    fclose(text);
+    _assert(strstr(buf, " MOV A, 0x05") && strstr(buf, "A=0x0005"));
+    _assert(strstr(buf, " IFEQ A, 0x06"));
+    _assert(strstr(buf, "-MOV ^[B + 0x1234], [0x20]"));
+    _assert(strstr(buf, " ??? 0xFE"));
+
+    char bad[] = "not a trace";
+    FILE* f = tmpfile();
+    fwrite(bad, 1, sizeof bad, f);
+    rewind(f);
+    _assert(trace_decode(f, stdout) == -1);
+    fclose(f);
+
+    emulator_destroy();
+    return 0;
+}
+
+static int tracing()
+{
+    printf("Tracing:\n");
+    verify(trace_steps);
+    verify(trace_ring);
+    verify(trace_decoding);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ execution histogram
+
+static int profile_counts()
+{
+    load_program("       mov A, 5\n"
+                 "       mov [A + 0x10], B\n"
+                 "       ifeq A, 6\n"
+                 "       mov B, 1\n"
+                 ".loop: jmp .loop");
+    profile_reset();
+    _assert(emulator_run_cycles(1000, 0) == EMULATOR_STOP_NONE);
+
+    FILE* f = tmpfile();
+    if (!profile_enabled()) {
+        _assert(profile_dump_csv(f) == -1 && profile_dump_json(f) == -1);
+        fclose(f);
+        emulator_destroy();
+        return 0;
+    }
+
+    char buf[2048] = { 0 };
+    _assert(profile_dump_csv(f) == 0);
+    rewind(f);
+    fread(buf, 1, sizeof buf - 1, f);
+    fclose(f);
+    _assert(strstr(buf, "opcode,MOV,,,2\n"));     // the skipped instruction is not counted
+    _assert(strstr(buf, "opcode,IFEQ,,,1\n"));
+    _assert(strstr(buf, "opcode,JMP,,,1\n"));     // idle steps are not executed
+    _assert(strstr(buf, "mode,,,reg,3\n"));
+    _assert(strstr(buf, "mode,,,[reg+v8],1\n"));
+    _assert(strstr(buf, "pair,MOV,1,[reg+v8],1\n"));
+    _assert(strstr(buf, "pair,MOV,2,literal,1\n"));
+    _assert(strstr(buf, "sequence,MOV,,MOV,1\n"));
+    _assert(strstr(buf, "sequence,MOV,,IFEQ,1\n"));
+    _assert(strstr(buf, "sequence,IFEQ,,JMP,1\n"));      // the skipped instruction is not counted
+
+    f = tmpfile();
+    memset(buf, 0, sizeof buf);
+    _assert(profile_dump_json(f) == 0);
+    rewind(f);
+    fread(buf, 1, sizeof buf - 1, f);
+    fclose(f);
+    _assert(strstr(buf, "\"opcodes\":{\"MOV\":2,"));
+    _assert(strstr(buf, "{\"opcode\":\"MOV\",\"operand\":1,\"mode\":\"[reg+v8]\",\"count\":1}"));
+
+    emulator_destroy();
+    return 0;
+}
+
+static int execution_histogram()
+{
+    printf("Execution histogram:\n");
+    verify(profile_counts);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ savestates
+
+static const char* snapshot_code =
+        "        ivec INT_TIMER, .int\n"
+        "        mov ^[TIMER_FRAME_0], 3\n"
+        ".loop:  add A, [CPU_RANDOM]\n"
+        "        inc ^[0x1000]\n"
+        "        jmp .loop\n"
+        ".int:   inc K\n"
+        "        mov ^[TIMER_FRAME_0], 3\n"
+        "        iret";
+
+typedef struct {
+    reg_t   registers[16];
+    uint8_t memory[0x10000];
+} MachineState;
+
+static void
+run_frames(int frames, MachineState* st)
+{
+    for (int i = 0; i < frames; ++i)
+        _assert(emulator_frame() == CPU_ERROR_NO_ERROR);
+    for (int i = 0; i < 16; ++i)
+        st->registers[i] = cpu_register(i);
+    memcpy(st->memory, ram, sizeof st->memory);
+}
+
+static int snapshot_restore()
+{
+    static MachineState st1, st2;
+    Snapshot* s = malloc(sizeof(Snapshot));
+
+    load_program(snapshot_code);
+    cpu_set_random_seed(7);
+    run_frames(3, &st1);
+    emulator_snapshot(s);
+    run_frames(10, &st1);
+    _assert(st1.registers[8] > 0);   // timer interrupts happened
+
+    _assert(emulator_restore(s) == 0);
+    run_frames(10, &st2);
+    _assert(memcmp(&st1, &st2, sizeof st1) == 0);
+
+    // in another machine
+    RetrolabMachine* m = machine_new();
+    _assert(machine_restore(m, s) == 0);
+    RetrolabMachine* previous = machine_select(m);
+    run_frames(10, &st2);
+    machine_select(previous);
+    machine_free(m);
+    _assert(memcmp(&st1, &st2, sizeof st1) == 0);
+
+    // invalid snapshots are not restored
+    s->version = SNAPSHOT_VERSION + 1;
+    _assert(emulator_restore(s) == -1);
+
+    free(s);
+    emulator_destroy();
+    return 0;
+}
+
+static int snapshot_file()
+{
+    static MachineState st1, st2;
+
+    load_program(snapshot_code);
+    run_frames(3, &st1);
+    _assert(snapshot_save("snapshot.tmp") == 0);
+    run_frames(10, &st1);
+
+    const Snapshot* s = snapshot_map("snapshot.tmp");
+    _assert(s != NULL);
+    _assert(emulator_restore(s) == 0);
+    snapshot_unmap(s);
+    run_frames(10, &st2);
+    _assert(memcmp(&st1, &st2, sizeof st1) == 0);
+
+    FILE* f = fopen("snapshot.tmp", "wb");
+    fwrite(snapshot_code, 1, strlen(snapshot_code), f);
+    fclose(f);
+    _assert(snapshot_map("snapshot.tmp") == NULL);
+    _assert(snapshot_map("does-not-exist.tmp") == NULL);
+    remove("snapshot.tmp");
+
+    emulator_destroy();
+    return 0;
+}
+
+static int savestates()
+{
+    printf("Savestates:\n");
+    verify(snapshot_restore);
+    verify(snapshot_file);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ rewind
+
+static int rewind_frames()
+{
+    MachineState* st = malloc(sizeof(MachineState) * 11);
+
+    load_program(snapshot_code);
+    history_start(HISTORY_DEFAULT_FRAMES, HISTORY_DEFAULT_BUDGET, HISTORY_KEYFRAME_INTERVAL);
+    run_frames(0, &st[0]);
+    for (int i = 1; i <= 10; ++i)
+        run_frames(1, &st[i]);
+    _assert(history_frames() == 10);
+
+    MachineState now;
+    _assert(history_back(1) == 1);
+    run_frames(0, &now);
+    _assert(memcmp(&now, &st[9], sizeof now) == 0);
+    _assert(history_back(3) == 3);
+    run_frames(0, &now);
+    _assert(memcmp(&now, &st[6], sizeof now) == 0);
+    _assert(history_frames() == 6);
+
+    // running forward again gives the same frames
+    run_frames(1, &now);
+    _assert(memcmp(&now, &st[7], sizeof now) == 0);
+    _assert(history_frames() == 7);
+
+    _assert(history_back(100) == 7);
+    run_frames(0, &now);
+    _assert(memcmp(&now, &st[0], sizeof now) == 0);
+    _assert(history_back(1) == 0);
+
+    free(st);
+    emulator_destroy();
+    _assert(!history_enabled());
+    return 0;
+}
+
+static int rewind_keyframes()
+{
+    MachineState* st = malloc(sizeof(MachineState) * 21);
+
+    load_program(snapshot_code);
+    history_start(HISTORY_DEFAULT_FRAMES, HISTORY_DEFAULT_BUDGET, 4);
+    run_frames(0, &st[0]);
+    for (int i = 1; i <= 20; ++i)
+        run_frames(1, &st[i]);
+
+    MachineState now;
+    for (int i = 19; i >= 2; i -= 3) {
+        _assert(history_back(3) == 3);
+        run_frames(0, &now);
+        _assert(memcmp(&now, &st[i - 2], sizeof now) == 0);
+    }
+
+    free(st);
+    emulator_destroy();
+    return 0;
+}
+
+static int rewind_budget()
+{
+    const int frames = 300;
+    MachineState* st = malloc(sizeof(MachineState) * (frames + 1));
+
+    // every frame changes a lot of memory, so only a few frames fit
+    load_program("        ivec INT_TIMER, .int\n"
+                 "        mov ^[TIMER_FRAME_0], 1\n"
+                 "        mov A, 0x4000\n"
+                 ".loop:  mov [A], [CPU_RANDOM]\n"
+                 "        add A, 7\n"
+                 "        ifgt A, 0x7fff\n"
+                 "        mov A, 0x4000\n"
+                 "        jmp .loop\n"
+                 ".int:   mov ^[TIMER_FRAME_0], 1\n"
+                 "        iret");
+    history_start(100, 256 * 1024, 10);
+    run_frames(0, &st[0]);
+    for (int i = 1; i <= frames; ++i)
+        run_frames(1, &st[i]);
+    int n = history_frames();
+    _assert(n > 2 && n < 100);
+
+    MachineState now;
+    _assert(history_back(n) == n);
+    run_frames(0, &now);
+    _assert(memcmp(&now, &st[frames - n], sizeof now) == 0);
+
+    // only a maximum number of frames are kept
+    history_start(5, HISTORY_DEFAULT_BUDGET, HISTORY_KEYFRAME_INTERVAL);
+    for (int i = 0; i < 10; ++i)
+        run_frames(1, &now);
+    _assert(history_frames() == 5);
+
+    free(st);
+    emulator_destroy();
+    return 0;
+}
+
+static int rewind_history()
+{
+    printf("Rewind:\n");
+    verify(rewind_frames);
+    verify(rewind_keyframes);
+    verify(rewind_budget);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ record / replay
+
+static const char* replay_code =
+        "        ivec INT_KEYBOARD, .key\n"
+        "        ivec INT_JOYSTICK, .joy\n"
+        "        ivec INT_TIMER, .int\n"
+        "        mov ^[TIMER_FRAME_0], 3\n"
+        "        mov B, 0x2000\n"
+        ".loop:  add A, [CPU_RANDOM]\n"
+        "        jmp .loop\n"
+        ".key:   mov ^[B], XT\n"
+        "        add B, 2\n"
+        "        mov ^[B], A\n"
+        "        add B, 2\n"
+        "        iret\n"
+        ".joy:   mov C, [JOYSTICK_STATE]\n"
+        "        mov [B], C\n"
+        "        add B, 1\n"
+        "        iret\n"
+        ".int:   inc K\n"
+        "        mov ^[TIMER_FRAME_0], 3\n"
+        "        iret";
+
+// runs a few frames, with input from the host at odd moments
+static void
+replay_session(MachineState* st)
+{
+    for (int i = 0; i < 20; ++i) {
+        emulator_run_cycles(1000 + i * 3777, 0);
+        replay_input_interrupt(INT_KEYBOARD, 'a' + i);
+        if (i % 3 == 0) {
+            replay_input_ram(JOYSTICK_STATE, i);
+            replay_input_interrupt(INT_JOYSTICK, i);
+        }
+    }
+    emulator_run_cycles(500, 0);
+    run_frames(0, st);
+}
+
+static int replay_roundtrip()
+{
+    static MachineState st1, st2;
+
+    load_program(replay_code);
+    _assert(replay_record("replay.tmp", 42) == 0);
+    _assert(replay_recording());
+    replay_session(&st1);
+    replay_stop();
+    _assert(st1.registers[8] > 0);          // timer interrupts happened
+    _assert(ram_get16(0x2000) == 'a');      // and input was received
+
+    // the input from the host is ignored while playing
+    load_program(replay_code);
+    _assert(replay_play("replay.tmp") == 0);
+    _assert(replay_playing() && !replay_finished());
+    replay_input_interrupt(INT_KEYBOARD, 'z');
+    _assert(replay_run() == CPU_ERROR_NO_ERROR);
+    _assert(replay_finished());
+    run_frames(0, &st2);
+    _assert(memcmp(&st1, &st2, sizeof st1) == 0);
+    replay_stop();
+
+    // the same, stopping at the end of each frame
+    load_program(replay_code);
+    _assert(replay_play("replay.tmp") == 0);
+    while (!replay_finished())
+        replay_run_cycles(STEPS_PER_FRAME, EMULATOR_STOP_END_OF_FRAME);
+    run_frames(0, &st2);
+    _assert(memcmp(&st1, &st2, sizeof st1) == 0);
+
+    emulator_destroy();
+    _assert(!replay_playing());
+    remove("replay.tmp");
+    return 0;
+}
+
+static int replay_invalid()
+{
+    load_program(replay_code);
+    _assert(replay_record("replay.tmp", 42) == 0);
+    emulator_run_cycles(1000, 0);
+    replay_stop();
+
+    // recorded from another program
+    load_program(snapshot_code);
+    _assert(replay_play("replay.tmp") == -1);
+    _assert(!replay_playing());
+
+    FILE* f = fopen("replay.tmp", "wb");
+    fwrite(replay_code, 1, strlen(replay_code), f);
+    fclose(f);
+    load_program(replay_code);
+    _assert(replay_play("replay.tmp") == -1);
+    _assert(replay_play("does-not-exist.tmp") == -1);
+    remove("replay.tmp");
+
+    emulator_destroy();
+    return 0;
+}
+
+static int record_replay()
+{
+    printf("Record / replay:\n");
+    verify(replay_roundtrip);
+    verify(replay_invalid);
+    printf("\n");
+    return 0;
+}
+
+// }}}
+
+// {{{ video
+
+#define PIXEL(x, y) (pixels[(y) * FRAMEBUFFER_W + (x)])
+
+static int framebuffer_cells()
+{
+    const int b = FRAMEBUFFER_BORDER;
+
+    emulator_init(true);
+    const uint8_t palette[] = { 0, 0, 0, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 0x90 };
+    memcpy(&ram[VIDEO_PALETTE], palette, sizeof palette);
+    ram[VIDEO_BORDER] = 3;
+    ram[VIDEO_TXT] = 'A';
+    ram[VIDEO_TXT_COLOR] = (1 << 4) | 2;
+    ram[VIDEO_TXT_COLOR + 1] = (1 << 4) | 2;
+    ram[VIDEO_CURSOR_INFO] = (1 << 4) | 3;      // visible
+    ram[VIDEO_CURSOR_POS] = 1;
+    framebuffer_invalidate();
+    _assert(framebuffer_update());
+    const uint32_t* pixels = framebuffer_pixels();
+
+    _assert(PIXEL(0, 0) == 0xff708090 && PIXEL(FRAMEBUFFER_W - 1, b + 4) == 0xff708090);
+    _assert(PIXEL(FRAMEBUFFER_W - 1, FRAMEBUFFER_H - 1) == 0xff708090);
+    _assert(PIXEL(b, b) == 0xff405060);                 // background
+    _assert(PIXEL(b + 2, b + 1) == 0xff102030);         // top of the A
+    _assert(PIXEL(b + 1, b + 1) == 0xff405060);
+    _assert(PIXEL(b + 6, b) == 0xff708090);             // cursor
+    _assert(PIXEL(b + 12, b) == 0xff000000);            // nothing set: black
+    emulator_destroy();
+    return 0;
+}
+
+static int framebuffer_dirty_cells()
+{
+    const int b = FRAMEBUFFER_BORDER;
+
+    load_program("mov  X, VIDEO_TXT_COLOR + 40\n"
+                 "mov  Y, 2\n"
+                 "mov  F, 0x01\n"
+                 "dev  DEV_MEM_MGR, MEM_SET\n"
+                 ".loop: jmp .loop");
+    const uint32_t black = 0xff1a1c2c;  // the default palette
+    ram_set(VIDEO_PALETTE + 3, 0xff);   // color 1: red
+    ram_set(VIDEO_PALETTE + 4, 0);
+    ram_set(VIDEO_PALETTE + 5, 0);
+    _assert(framebuffer_update());
+    _assert(!framebuffer_update());     // nothing changed
+    const uint32_t* pixels = framebuffer_pixels();
+
+    // only the cells written through the memory are drawn again
+    ram[VIDEO_TXT_COLOR + 2] = 0x01;
+    ram_set(VIDEO_TXT_COLOR + 3, 0x01);
+    _assert(framebuffer_update());
+    _assert(PIXEL(b + 12, b) == black && PIXEL(b + 18, b) == 0xffff0000);
+
+    // block writes from the memory manager
+    emulator_run_cycles(100, 0);
+    _assert(framebuffer_update());
+    _assert(PIXEL(b + 6, b + 9) == 0xffff0000 && PIXEL(b + 12, b + 9) == black);
+
+    // the cursor, wherever it moves
+    ram_set(VIDEO_CURSOR_INFO, (1 << 4) | 1);
+    _assert(framebuffer_update());
+    _assert(PIXEL(b, b) == 0xffff0000);
+    ram_set16(VIDEO_CURSOR_POS, 5);
+    _assert(framebuffer_update());
+    _assert(PIXEL(b, b) == black && PIXEL(b + 30, b) == 0xffff0000);
+    _assert(!framebuffer_update());
+
+    // the border changes everything, even the cells written behind its back
+    ram_set(VIDEO_BORDER, 1);
+    _assert(framebuffer_update());
+    _assert(PIXEL(0, 0) == 0xffff0000 && PIXEL(b + 12, b) == 0xffff0000);
+    emulator_destroy();
+    return 0;
+}
+
+#undef PIXEL
+
+static int framebuffer_headless()
+{
+    load_program("        mov  A, VIDEO_TXT + 41\n"
+                 "        mov  [A], 'H'\n"
+                 "        mov  [A + 1], 'i'\n"
+                 ".loop:  jmp .loop");
+    emulator_run_cycles(STEPS_PER_FRAME, 0);
+
+    char text[FRAMEBUFFER_TEXT_SZ];
+    _assert(framebuffer_text(text) == FRAMEBUFFER_TEXT_SZ - 1);
+    _assert(strncmp(&text[41], " Hi   ", 6) == 0 && text[40] == '\n' && text[FRAMEBUFFER_TEXT_SZ - 2] == '\n');
+
+    char buf[64];
+    _assert(framebuffer_save("frame.tmp.txt") == 0);
+    FILE* f = fopen("frame.tmp.txt", "rb");
+    _assert(fread(buf, 1, sizeof buf, f) == sizeof buf && strncmp(&buf[41], " Hi", 3) == 0);
+    fclose(f);
+
+    _assert(framebuffer_save("frame.tmp.ppm") == 0);
+    f = fopen("frame.tmp.ppm", "rb");
+    _assert(fread(buf, 1, 16, f) == 16 && strncmp(buf, "P6\n260 290\n255\n", 15) == 0);
+    fseek(f, 0, SEEK_END);
+    _assert(ftell(f) == 15 + FRAMEBUFFER_W * FRAMEBUFFER_H * 3);
+    fclose(f);
+
+    _assert(framebuffer_save("frame.tmp.png") == 0);
+    f = fopen("frame.tmp.png", "rb");
+    _assert(fread(buf, 1, 8, f) == 8 && memcmp(buf, "\x89PNG\r\n\x1a\n", 8) == 0);
+    fclose(f);
+
+    remove("frame.tmp.txt");
+    remove("frame.tmp.ppm");
+    remove("frame.tmp.png");
+    emulator_destroy();
+    return 0;
+}
+
+static int video_recording()
+{
+    const long frame_sz = FRAMEBUFFER_W * FRAMEBUFFER_H * 3;
+    const char header[] = "YUV4MPEG2 W260 H290 F60:1 Ip A1:1 C444\n";
+
+    load_program("        mov  A, VIDEO_TXT\n"
+                 "        mov  [A], 'H'\n"
+                 ".loop:  jmp .loop");
+    _assert(recorder_start("video.tmp.y4m", true) == 0 && recorder_recording());
+    emulator_run_cycles(STEPS_PER_FRAME * 2, 0);
+    ram_set(VIDEO_TXT + 1, 'i');
+    emulator_run_cycles(STEPS_PER_FRAME, 0);
+    _assert(recorder_stop() == 0 && !recorder_recording() && recorder_dropped() == 0);
+
+    FILE* f = fopen("video.tmp.y4m", "rb");
+    char buf[sizeof header];
+    _assert(fread(buf, 1, sizeof header - 1, f) == sizeof header - 1 && memcmp(buf, header, sizeof header - 1) == 0);
+    uint8_t* frames = malloc(frame_sz * 3);
+    for (int i = 0; i < 3; ++i) {
+        _assert(fread(buf, 1, 6, f) == 6 && memcmp(buf, "FRAME\n", 6) == 0);
+        _assert(fread(&frames[i * frame_sz], 1, frame_sz, f) == (size_t) frame_sz);
+    }
+    _assert(fgetc(f) == EOF);
+    fclose(f);
+    _assert(memcmp(frames, &frames[frame_sz], frame_sz) == 0);                  // the same frame, repeated
+    _assert(memcmp(&frames[frame_sz], &frames[frame_sz * 2], frame_sz) != 0);
+    free(frames);
+
+    // raw RGB, starting from the screen as it is
+    ram_set(VIDEO_BORDER, 1);
+    ram_set(VIDEO_PALETTE + 3, 0xff);   // color 1: red
+    ram_set(VIDEO_PALETTE + 4, 0);
+    ram_set(VIDEO_PALETTE + 5, 0);
+    _assert(recorder_start("video.tmp.rgb", true) == 0);
+    emulator_run_cycles(STEPS_PER_FRAME, 0);
+    _assert(recorder_stop() == 0);
+    f = fopen("video.tmp.rgb", "rb");
+    _assert(fread(buf, 1, 3, f) == 3 && memcmp(buf, "\xff\0\0", 3) == 0);
+    fseek(f, 0, SEEK_END);
+    _assert(ftell(f) == frame_sz);
+    fclose(f);
+
+    remove("video.tmp.y4m");
+    remove("video.tmp.rgb");
+    emulator_destroy();
+    return 0;
+}
+
+static int video()
+{
+    printf("Video:\n");
+    verify(framebuffer_cells);
+    verify(framebuffer_dirty_cells);
+    verify(framebuffer_headless);
+    verify(video_recording);
     printf("\n");
     return 0;
 }
@@ -1308,8 +2816,18 @@ int main()
                  + jumps()
                  + interrupts()
                  + external()
+                 + decoding()
+                 + engines()
+                 + machines()
                  + emulator_debug()
                  + breakpoints()
+                 + run_cycles()
+                 + tracing()
+                 + execution_histogram()
+                 + savestates()
+                 + rewind_history()
+                 + record_replay()
+                 + video()
                  + execution()
                  + error_handling()
                  + real_examples();